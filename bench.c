@@ -0,0 +1,312 @@
+/* Frame timing for --bench. The main loops bracket each frame with
+ * bench_begin_frame() / bench_end_frame() and call bench_mark() after each
+ * step; the time since the previous mark is charged to that step. Frame time
+ * is measured end to end, so it also covers whatever the loop does between
+ * the marked steps.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <inttypes.h>
+#include <math.h>
+
+#include "common.h"
+
+static const char *phase_names[BENCH_PHASE_COUNT] = {
+   [BENCH_PHASE_WAIT] = "wait",
+   [BENCH_PHASE_ACQUIRE] = "acquire",
+   [BENCH_PHASE_RENDER] = "render",
+   [BENCH_PHASE_PRESENT] = "present",
+};
+
+uint64_t
+bench_now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+struct bench *
+bench_create(uint32_t warmup, uint32_t frames)
+{
+   struct bench *b = calloc(1, sizeof(*b));
+
+   fail_if(!b, "out of memory");
+   b->warmup = warmup;
+   b->frames = frames;
+   b->frame_ns = calloc(frames, sizeof(*b->frame_ns));
+   b->gpu_ns = calloc(frames, sizeof(*b->gpu_ns));
+   b->gpu_compute_ns = calloc(frames, sizeof(*b->gpu_compute_ns));
+   fail_if(!b->frame_ns || !b->gpu_ns || !b->gpu_compute_ns, "out of memory");
+
+   return b;
+}
+
+void
+bench_destroy(struct bench *b)
+{
+   if (!b)
+      return;
+
+   free(b->frame_ns);
+   free(b->gpu_ns);
+   free(b->gpu_compute_ns);
+   free(b);
+}
+
+void
+bench_begin_frame(struct vkcube *vc)
+{
+   struct bench *b = vc->bench;
+
+   if (!b)
+      return;
+
+   b->lap_ns = bench_now();
+   if (b->last_ns == 0)
+      b->last_ns = b->lap_ns;
+   memset(b->phase_ns, 0, sizeof(b->phase_ns));
+}
+
+void
+bench_mark(struct vkcube *vc, enum bench_phase phase)
+{
+   struct bench *b = vc->bench;
+
+   if (!b)
+      return;
+
+   uint64_t now = bench_now();
+   b->phase_ns[phase] += now - b->lap_ns;
+   b->lap_ns = now;
+}
+
+bool
+bench_end_frame(struct vkcube *vc)
+{
+   struct bench *b = vc->bench;
+
+   if (!b)
+      return false;
+
+   uint64_t now = bench_now();
+
+   if (b->count >= b->warmup) {
+      b->frame_ns[b->count - b->warmup] = now - b->last_ns;
+      for (int i = 0; i < BENCH_PHASE_COUNT; i++)
+         b->phase_total_ns[i] += b->phase_ns[i];
+   }
+
+   b->last_ns = now;
+   b->count++;
+
+   return b->count >= b->warmup + b->frames;
+}
+
+/* GPU time of a render pass, which arrives a few frames after the frame that
+ * recorded it. Samples read back during the warm-up are dropped. */
+void
+bench_gpu_sample(struct vkcube *vc, uint64_t ns)
+{
+   struct bench *b = vc->bench;
+
+   if (!b || b->count < b->warmup || b->gpu_count >= b->frames)
+      return;
+
+   b->gpu_ns[b->gpu_count++] = ns;
+}
+
+/* GPU time of the --gpu-animate and --gpu-cull passes before the render
+ * pass, sampled like bench_gpu_sample(). */
+void
+bench_gpu_compute_sample(struct vkcube *vc, uint64_t ns)
+{
+   struct bench *b = vc->bench;
+
+   if (!b || b->count < b->warmup || b->gpu_compute_count >= b->frames)
+      return;
+
+   b->gpu_compute_ns[b->gpu_compute_count++] = ns;
+}
+
+/* Instances that survived --gpu-cull in a frame, read back like the GPU
+ * times. */
+void
+bench_cull_sample(struct vkcube *vc, uint32_t visible)
+{
+   struct bench *b = vc->bench;
+
+   if (!b || b->count < b->warmup)
+      return;
+
+   b->visible_total += visible;
+   b->visible_count++;
+}
+
+static int
+compare_u64(const void *a, const void *b)
+{
+   uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+   return x < y ? -1 : x > y;
+}
+
+static void
+sort_u64(uint64_t *sorted, const uint64_t *samples, uint32_t n)
+{
+   memcpy(sorted, samples, n * sizeof(*sorted));
+   qsort(sorted, n, sizeof(*sorted), compare_u64);
+}
+
+/* Nearest-rank percentile of a sorted array. */
+static double
+percentile_ms(const uint64_t *sorted, uint32_t n, double p)
+{
+   uint32_t rank = (uint32_t) ceil(p / 100.0 * n);
+
+   if (rank < 1)
+      rank = 1;
+   if (rank > n)
+      rank = n;
+
+   return sorted[rank - 1] / 1e6;
+}
+
+/* Writes the "name" statistics of n GPU samples, sorting them into sorted,
+ * and returns their total. */
+static uint64_t
+report_gpu_ms(FILE *f, const char *name, uint64_t *sorted,
+              const uint64_t *samples, uint32_t n)
+{
+   uint64_t total_ns = 0;
+
+   if (n == 0) {
+      fprintf(f, "  \"%s\": null,\n", name);
+      return 0;
+   }
+
+   sort_u64(sorted, samples, n);
+   for (uint32_t i = 0; i < n; i++)
+      total_ns += sorted[i];
+
+   fprintf(f, "  \"%s\": {\n", name);
+   fprintf(f, "    \"samples\": %u,\n", n);
+   fprintf(f, "    \"avg\": %.4f,\n", total_ns / 1e6 / n);
+   fprintf(f, "    \"p50\": %.4f,\n", percentile_ms(sorted, n, 50));
+   fprintf(f, "    \"p90\": %.4f,\n", percentile_ms(sorted, n, 90));
+   fprintf(f, "    \"p99\": %.4f,\n", percentile_ms(sorted, n, 99));
+   fprintf(f, "    \"max\": %.4f\n", sorted[n - 1] / 1e6);
+   fprintf(f, "  },\n");
+
+   return total_ns;
+}
+
+static const char *
+present_mode_name(VkPresentModeKHR mode)
+{
+   switch (mode) {
+   case VK_PRESENT_MODE_IMMEDIATE_KHR:
+      return "immediate";
+   case VK_PRESENT_MODE_MAILBOX_KHR:
+      return "mailbox";
+   case VK_PRESENT_MODE_FIFO_KHR:
+      return "fifo";
+   default:
+      return "other";
+   }
+}
+
+void
+bench_report(struct vkcube *vc, FILE *f)
+{
+   struct bench *b = vc->bench;
+   uint32_t n = b->count > b->warmup ? b->count - b->warmup : 0;
+
+   if (n == 0) {
+      fprintf(stderr, "bench: no frames measured\n");
+      return;
+   }
+
+   /* Scratch space for both the frame and the GPU samples. */
+   uint64_t *sorted = malloc(b->frames * sizeof(*sorted));
+   fail_if(!sorted, "out of memory");
+   sort_u64(sorted, b->frame_ns, n);
+
+   uint64_t total_ns = 0;
+   for (uint32_t i = 0; i < n; i++)
+      total_ns += sorted[i];
+
+   fprintf(f, "{\n");
+   fprintf(f, "  \"device\": \"%s\",\n", vc->properties.deviceName);
+   fprintf(f, "  \"driver_version\": %" PRIu32 ",\n",
+           vc->properties.driverVersion);
+   fprintf(f, "  \"mode\": \"%s\",\n", vc->swap_chain ? "swapchain" : "headless");
+   fprintf(f, "  \"present_mode\": \"%s\",\n",
+           vc->swap_chain ? present_mode_name(vc->present_mode) : "none");
+   fprintf(f, "  \"width\": %u,\n", vc->width);
+   fprintf(f, "  \"height\": %u,\n", vc->height);
+   fprintf(f, "  \"frames_in_flight\": %u,\n", vc->frames_in_flight);
+   fprintf(f, "  \"cubes\": %u,\n", vc->instance_count);
+   if (b->visible_count == 0)
+      fprintf(f, "  \"visible_cubes\": null,\n");
+   else
+      fprintf(f, "  \"visible_cubes\": %.1f,\n",
+              (double) b->visible_total / b->visible_count);
+   fprintf(f, "  \"vertex_layout\": \"%s\",\n",
+           vc->interleaved ? "interleaved" : "separate");
+   fprintf(f, "  \"vertex_format\": \"%s\",\n",
+           vc->compact_vertices ? "compact" : "float");
+   fprintf(f, "  \"prerecorded\": %s,\n", vc->prerecord ? "true" : "false");
+   fprintf(f, "  \"transforms\": \"%s\",\n",
+           vc->push_constants ? "push_constants" : "ubo");
+   fprintf(f, "  \"animation\": \"%s\",\n", vc->gpu_animate ? "gpu" : "cpu");
+   if (vc->clock.fixed_dt_ns)
+      fprintf(f, "  \"fixed_dt_ms\": %.6f,\n", vc->clock.fixed_dt_ns / 1e6);
+   else
+      fprintf(f, "  \"fixed_dt_ms\": null,\n");
+   fprintf(f, "  \"warmup_frames\": %u,\n", b->warmup);
+   fprintf(f, "  \"frames\": %u,\n", n);
+   fprintf(f, "  \"avg_fps\": %.3f,\n", n / (total_ns / 1e9));
+   fprintf(f, "  \"frame_time_ms\": {\n");
+   fprintf(f, "    \"avg\": %.4f,\n", total_ns / 1e6 / n);
+   fprintf(f, "    \"p50\": %.4f,\n", percentile_ms(sorted, n, 50));
+   fprintf(f, "    \"p90\": %.4f,\n", percentile_ms(sorted, n, 90));
+   fprintf(f, "    \"p99\": %.4f,\n", percentile_ms(sorted, n, 99));
+   fprintf(f, "    \"max\": %.4f\n", sorted[n - 1] / 1e6);
+   fprintf(f, "  },\n");
+   fprintf(f, "  \"cpu_ms_per_frame\": {\n");
+   for (int i = 0; i < BENCH_PHASE_COUNT; i++)
+      fprintf(f, "    \"%s\": %.4f%s\n", phase_names[i],
+              b->phase_total_ns[i] / 1e6 / n,
+              i + 1 < BENCH_PHASE_COUNT ? "," : "");
+   fprintf(f, "  },\n");
+
+   uint32_t g = b->gpu_count;
+   uint64_t gpu_total_ns = report_gpu_ms(f, "gpu_render_pass_ms", sorted,
+                                         b->gpu_ns, g);
+   report_gpu_ms(f, "gpu_compute_ms", sorted, b->gpu_compute_ns,
+                 b->gpu_compute_count);
+
+   /* Vertices fetched per second, to compare vertex layouts. The GPU
+    * figure excludes CPU and presentation overhead. Culled cubes are never
+    * fetched. */
+   double cubes = b->visible_count ?
+      (double) b->visible_total / b->visible_count : vc->instance_count;
+   double vertices = vc->index_count * cubes;
+   fprintf(f, "  \"vertex_fetch\": {\n");
+   fprintf(f, "    \"vertices_per_frame\": %.0f,\n", vertices);
+   fprintf(f, "    \"mvertices_per_s\": %.3f,\n",
+           vertices * n / (total_ns / 1e3));
+   if (g == 0)
+      fprintf(f, "    \"mvertices_per_s_gpu\": null\n");
+   else
+      fprintf(f, "    \"mvertices_per_s_gpu\": %.3f\n",
+              vertices * g / (gpu_total_ns / 1e3));
+   fprintf(f, "  }\n");
+   fprintf(f, "}\n");
+
+   free(sorted);
+}
@@ -1,9 +1,11 @@
 define define_c_target
 $(1)_src_files:=$(2)
-$(1)_obj_files:=$$($(1)_src_files:.c=.o)
+$(1)_obj_dir:=.obj/$(1)
+$(1)_obj_files:=$$($(1)_src_files:%.c=$$($(1)_obj_dir)/%.o)
 
-$$($(1)_obj_files): %.o: %.c
+$$($(1)_obj_files): $$($(1)_obj_dir)/%.o: %.c
 	@echo "\tCC\t$$@"
+	@mkdir -p $$(@D)
 	$$(CC) -c $$< -o $$@ $$($(1)_cflags)
 
 $(1): $$($(1)_obj_files)
@@ -12,5 +14,5 @@ $(1): $$($(1)_obj_files)
 
 $(1)_clean:
 	@echo "\tCLEAN\t$(1)"
-	rm -f $$($(1)_obj_files) $(1)
+	rm -rf $$($(1)_obj_dir) $(1)
 endef
\ No newline at end of file
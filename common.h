@@ -1,7 +1,7 @@
 #include <stdarg.h>
 #include <stdnoreturn.h>
-#include <sys/time.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <string.h>
 #include <strings.h>
 
@@ -16,6 +16,8 @@
 #define printflike(a, b) __attribute__((format(printf, (a), (b))))
 
 #define MAX_NUM_IMAGES 4
+#define MAX_FRAMES_IN_FLIGHT 4
+#define MAX_INSTANCES 1000000
 
 struct vkcube_buffer {
    struct gbm_bo *gbm_bo;
@@ -25,6 +27,15 @@ struct vkcube_buffer {
    VkFramebuffer framebuffer;
    VkFence fence;
    VkCommandBuffer cmd_buffer;
+   VkSemaphore acquire_semaphore;
+   VkSemaphore render_semaphore;
+   VkImage depth_image;
+   VkDeviceMemory depth_mem;
+   VkImageView depth_view;
+   VkQueryPool query_pool;
+   bool query_pending;
+   bool recorded;
+   bool cull_pending;
 
    uint32_t fb;
    uint32_t stride;
@@ -32,6 +43,49 @@ struct vkcube_buffer {
 
 struct vkcube;
 
+enum bench_phase {
+   BENCH_PHASE_WAIT,
+   BENCH_PHASE_ACQUIRE,
+   BENCH_PHASE_RENDER,
+   BENCH_PHASE_PRESENT,
+   BENCH_PHASE_COUNT
+};
+
+struct bench {
+   uint32_t warmup, frames;
+   uint32_t count;
+   uint64_t last_ns, lap_ns;
+   uint64_t phase_ns[BENCH_PHASE_COUNT];
+   uint64_t phase_total_ns[BENCH_PHASE_COUNT];
+   uint64_t *frame_ns;
+   uint64_t *gpu_ns;
+   uint32_t gpu_count;
+   uint64_t *gpu_compute_ns;
+   uint32_t gpu_compute_count;
+   uint64_t visible_total;
+   uint32_t visible_count;
+};
+
+#define STARTUP_MAX_PHASES 24
+
+struct startup {
+   bool enabled, done;
+   const char *json_path;
+   uint64_t start_ns, last_ns;
+   uint32_t count;
+   struct {
+      const char *name;
+      uint64_t ns;
+   } phases[STARTUP_MAX_PHASES];
+};
+
+struct frame_clock {
+   uint64_t start_ns;
+   /* --fixed-dt: time advances this much per frame; 0 for real time. */
+   uint64_t fixed_dt_ns;
+   uint64_t frames;
+};
+
 struct model {
    void (*init)(struct vkcube *vc);
    void (*render)(struct vkcube *vc, struct vkcube_buffer *b);
@@ -54,39 +108,121 @@ struct vkcube {
    } khr;
 
    VkSwapchainKHR swap_chain;
+   VkPresentModeKHR present_mode;
 
    uint32_t width, height;
 
    VkInstance instance;
    VkPhysicalDevice physical_device;
+   VkPhysicalDeviceProperties properties;
    VkPhysicalDeviceMemoryProperties memory_properties;
+   uint32_t timestamp_valid_bits;
    VkDevice device;
    VkRenderPass render_pass;
    VkQueue queue;
    VkPipelineLayout pipeline_layout;
+   VkPipelineCache pipeline_cache;
    VkPipeline pipeline;
    VkDeviceMemory mem;
    VkBuffer buffer;
+   VkDeviceMemory geometry_mem;
+   VkBuffer geometry_buffer;
    VkDescriptorPool desc_pool;
    VkDescriptorSet descriptor_set;
    VkSemaphore semaphore;
    VkCommandPool cmd_pool;
 
    void *map;
-   uint32_t vertex_offset, colors_offset, normals_offset;
-
-   struct timeval start_tv;
+   uint32_t ubo_stride;
+   uint32_t vertex_offset, colors_offset, normals_offset, index_offset;
+   uint32_t index_count;
+
+   /* -c: cubes drawn per frame as instances, in a grid_size^3 lattice. */
+   uint32_t instance_count, grid_size;
+   VkBuffer instance_buffer;
+   VkDeviceSize instance_offset, instance_stride;
+
+   /* The CPU transforms: per-instance parameters as the arrays
+    * esComposeBatch() reads, built once in init_cube(). angle is rewritten
+    * every frame from phase and speed. */
+   float *instance_soa;
+   ESTransformSoA instance_xf;
+   float *instance_angle, *instance_phase, *instance_speed, *instance_color;
+
+   /* --gpu-animate: a compute pass writes the instance slices into
+    * animate_buffer from per-instance parameters in params_buffer. */
+   bool gpu_animate;
+   VkPipeline animate_pipeline;
+   VkPipelineLayout animate_pipeline_layout;
+   VkDescriptorSet animate_descriptor_set;
+   VkDeviceMemory animate_mem, params_mem;
+   VkBuffer animate_buffer, params_buffer;
+
+   /* --gpu-cull: a compute pass copies the visible instances into
+    * cull_buffer and counts them in an indirect draw command in buffer. */
+   bool gpu_cull;
+   VkPipeline cull_pipeline;
+   VkPipelineLayout cull_pipeline_layout;
+   VkDescriptorSet cull_descriptor_set;
+   VkDeviceMemory cull_mem;
+   VkBuffer cull_buffer;
+   VkDeviceSize indirect_offset, indirect_stride;
+
+   struct frame_clock clock;
    VkSurfaceKHR surface;
    VkFormat image_format;
+   VkFormat depth_format;
    struct vkcube_buffer buffers[MAX_NUM_IMAGES];
    uint32_t image_count;
    int current;
+
+   /* Buffers submitted in the last frames_in_flight frames, oldest first
+    * once the ring has wrapped. */
+   struct vkcube_buffer *inflight[MAX_FRAMES_IN_FLIGHT];
+   uint32_t frames_in_flight;
+   uint64_t frame;
+
+   /* Record each buffer's command buffer once and only refresh its UBO
+    * slice per frame. */
+   bool prerecord;
+
+   /* Deliver the matrices with vkCmdPushConstants instead of the UBO. */
+   bool push_constants;
+
+   /* Fetch position, color and normal from one interleaved binding. */
+   bool interleaved;
+
+   /* Half float positions and packed normalized colors and normals. */
+   bool compact_vertices;
+
+   struct bench *bench;
+   struct startup startup;
 };
 
 void noreturn failv(const char *format, va_list args);
 void noreturn fail(const char *format, ...) printflike(1, 2) ;
 void fail_if(int cond, const char *format, ...) printflike(2, 3);
 
+int find_memory_type(struct vkcube *vc, uint32_t allowed, VkMemoryPropertyFlags flags);
+
+uint64_t bench_now(void);
+struct bench *bench_create(uint32_t warmup, uint32_t frames);
+void bench_destroy(struct bench *b);
+void bench_begin_frame(struct vkcube *vc);
+void bench_mark(struct vkcube *vc, enum bench_phase phase);
+bool bench_end_frame(struct vkcube *vc);
+void bench_gpu_sample(struct vkcube *vc, uint64_t ns);
+void bench_gpu_compute_sample(struct vkcube *vc, uint64_t ns);
+void bench_cull_sample(struct vkcube *vc, uint32_t visible);
+void bench_report(struct vkcube *vc, FILE *f);
+
+void frame_clock_init(struct frame_clock *clock, uint64_t fixed_dt_ns);
+uint64_t frame_clock_next(struct frame_clock *clock);
+
+void startup_begin(struct vkcube *vc, bool enabled, const char *json_path);
+void startup_mark(struct vkcube *vc, const char *phase);
+void startup_finish(struct vkcube *vc, const char *phase);
+
 static inline bool
 streq(const char *a, const char *b)
 {
@@ -23,6 +23,11 @@
  * IN THE SOFTWARE.
  */
 
+#include <stddef.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <math.h>
+
 #include "common.h"
 
 struct ubo {
@@ -31,23 +36,674 @@ struct ubo {
    float normal[12];
 };
 
+/* Push constant block of vkcube-push.vert: the normal matrix columns carry
+ * the modelview translation in their w component. */
+struct push_constants {
+   ESMatrix modelviewprojection;
+   float normal[12];
+};
+
+/* Per-instance vertex data, binding 3. The model matrix is applied before
+ * the shared modelview and takes attribute locations 3 to 6. */
+struct instance {
+   ESMatrix model;
+   float color[4];
+};
+
+/* One vertex of the interleaved layout. Every attribute starts on a 16 byte
+ * boundary so a vertex never straddles more cache lines than necessary. */
+struct vertex {
+   float position[4];
+   float color[4];
+   float normal[4];
+};
+
+/* One vertex of the interleaved layout with --compact-vertices. */
+struct packed_vertex {
+   uint16_t position[4];        /* R16G16B16A16_SFLOAT */
+   uint8_t color[4];            /* R8G8B8A8_UNORM */
+   uint32_t normal;             /* A2B10G10R10_SNORM_PACK32 or R8G8B8A8_SNORM */
+};
+
+_Static_assert(sizeof(struct packed_vertex) == 16,
+               "packed vertex should stay 16 bytes");
+
+_Static_assert(sizeof(struct push_constants) <= 128,
+               "push constants exceed the guaranteed maxPushConstantsSize");
+
+/* Push constant block of vkcube-cull.comp. */
+struct cull_constants {
+   float planes[6][4];
+   uint32_t count;
+};
+
+_Static_assert(sizeof(struct cull_constants) <= 128,
+               "cull constants exceed the guaranteed maxPushConstantsSize");
+
+/* What it takes to animate one instance: the model matrix at time t is
+ * translate * rotate(speed * t + phase, axis) * scale. Laid out like the
+ * std430 params struct of vkcube-animate.comp. */
+struct instance_params {
+   float translate[3];
+   float scale;
+   float axis[3];
+   float phase;
+   float color[3];
+   float speed;
+};
+
+/* Push constant block of vkcube-animate.comp. */
+struct animate_constants {
+   float t;
+   uint32_t count;
+};
+
 static uint32_t vs_spirv_source[] = {
 #include "vkcube.vert.spv.h"
 };
 
+static uint32_t vs_push_spirv_source[] = {
+#include "vkcube-push.vert.spv.h"
+};
+
 static uint32_t fs_spirv_source[] = {
 #include "vkcube.frag.spv.h"
 };
 
-static int find_host_coherent_memory(struct vkcube *vc, unsigned allowed)
+static uint32_t cs_cull_spirv_source[] = {
+#include "vkcube-cull.comp.spv.h"
+};
+
+static uint32_t cs_animate_spirv_source[] = {
+#include "vkcube-animate.comp.spv.h"
+};
+
+static VkDeviceSize
+align_up(VkDeviceSize value, VkDeviceSize alignment)
+{
+   return (value + alignment - 1) / alignment * alignment;
+}
+
+/* Round to the nearest half float. Values too small for a normal half
+ * flush to zero and values too large become infinity; neither occurs in
+ * the cube geometry. */
+static uint16_t
+float_to_half(float f)
+{
+   union { float f; uint32_t u; } v = { f };
+   uint32_t sign = (v.u >> 16) & 0x8000;
+   int32_t exp = (int32_t) ((v.u >> 23) & 0xff) - 127 + 15;
+   uint32_t mant = v.u & 0x7fffff;
+
+   if (exp <= 0)
+      return sign;
+   if (exp >= 31)
+      return sign | 0x7c00;
+
+   /* A carry out of the mantissa correctly bumps the exponent. */
+   return (sign | (exp << 10) | (mant >> 13)) + ((mant >> 12) & 1);
+}
+
+static uint8_t
+pack_unorm8(float x)
+{
+   x = x < 0.0f ? 0.0f : x > 1.0f ? 1.0f : x;
+   return (uint8_t) (x * 255.0f + 0.5f);
+}
+
+/* Two's complement snorm of the given width, in the low bits. */
+static uint32_t
+pack_snorm(float x, unsigned bits)
+{
+   float scale = (float) ((1 << (bits - 1)) - 1);
+
+   x = x < -1.0f ? -1.0f : x > 1.0f ? 1.0f : x;
+   int32_t v = (int32_t) (x * scale + (x < 0.0f ? -0.5f : 0.5f));
+   return (uint32_t) v & ((1u << bits) - 1);
+}
+
+static uint32_t
+pack_normal(const float *n, VkFormat format)
+{
+   if (format == VK_FORMAT_A2B10G10R10_SNORM_PACK32)
+      return pack_snorm(n[0], 10) | pack_snorm(n[1], 10) << 10 |
+             pack_snorm(n[2], 10) << 20;
+   else
+      return pack_snorm(n[0], 8) | pack_snorm(n[1], 8) << 8 |
+             pack_snorm(n[2], 8) << 16;
+}
+
+static void
+print_memory_type(struct vkcube *vc, const char *what, int type, VkDeviceSize size)
+{
+   VkMemoryPropertyFlags flags = vc->memory_properties.memoryTypes[type].propertyFlags;
+
+   fprintf(stderr, "%s: memory type %d (heap %u%s%s%s%s), %" PRIu64 " bytes\n",
+                  what, type, vc->memory_properties.memoryTypes[type].heapIndex,
+                  flags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT ? ", device local" : "",
+                  flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT ? ", host visible" : "",
+                  flags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT ? ", host coherent" : "",
+                  flags & VK_MEMORY_PROPERTY_HOST_CACHED_BIT ? ", host cached" : "",
+                  size);
+}
+
+/* Allocate and bind memory for buffer, using the first type with all of
+ * the preferred flags and falling back to one with the required flags. The
+ * preferred type may sit in a small heap (e.g. a 256MB BAR window), so a
+ * failed allocation there also falls back. */
+static VkDeviceMemory
+allocate_buffer_memory(struct vkcube *vc, VkBuffer buffer, const char *what,
+                       VkMemoryPropertyFlags preferred,
+                       VkMemoryPropertyFlags required)
+{
+   VkMemoryRequirements reqs;
+   VkDeviceMemory mem = VK_NULL_HANDLE;
+   VkResult r = VK_ERROR_OUT_OF_DEVICE_MEMORY;
+
+   vkGetBufferMemoryRequirements(vc->device, buffer, &reqs);
+
+   int memory_type = find_memory_type(vc, reqs.memoryTypeBits, preferred);
+   if (memory_type >= 0)
+      r = vkAllocateMemory(vc->device,
+                           &(VkMemoryAllocateInfo) {
+                              .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+                              .allocationSize = reqs.size,
+                              .memoryTypeIndex = memory_type,
+                           },
+                           NULL,
+                           &mem);
+
+   if (r != VK_SUCCESS) {
+      memory_type = find_memory_type(vc, reqs.memoryTypeBits, required);
+      fail_if(memory_type < 0, "no memory type for %s", what);
+      r = vkAllocateMemory(vc->device,
+                           &(VkMemoryAllocateInfo) {
+                              .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+                              .allocationSize = reqs.size,
+                              .memoryTypeIndex = memory_type,
+                           },
+                           NULL,
+                           &mem);
+      fail_if(r != VK_SUCCESS, "failed to allocate memory for %s", what);
+   }
+
+   print_memory_type(vc, what, memory_type, reqs.size);
+   vkBindBufferMemory(vc->device, buffer, mem, 0);
+
+   return mem;
+}
+
+/* Copy data into the start of the device local buffer dst through a
+ * temporary staging buffer and wait for the copy to land. Only used at
+ * init, so a stall here is fine. dst_stage and dst_access describe how the
+ * data is read afterwards. */
+static void
+upload_buffer(struct vkcube *vc, VkBuffer dst, const void *data, VkDeviceSize size,
+              VkPipelineStageFlags dst_stage, VkAccessFlags dst_access)
+{
+   VkBuffer staging;
+   VkDeviceMemory staging_mem;
+   VkCommandBuffer cmd_buffer;
+   VkFence fence;
+   void *map;
+
+   vkCreateBuffer(vc->device,
+                  &(VkBufferCreateInfo) {
+                     .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+                     .size = size,
+                     .usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                     .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+                  },
+                  NULL,
+                  &staging);
+
+   VkMemoryRequirements reqs;
+   vkGetBufferMemoryRequirements(vc->device, staging, &reqs);
+
+   int memory_type = find_memory_type(vc, reqs.memoryTypeBits,
+                                      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                      VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+   fail_if(memory_type < 0, "no host visible memory for staging");
+
+   vkAllocateMemory(vc->device,
+                    &(VkMemoryAllocateInfo) {
+                       .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+                       .allocationSize = reqs.size,
+                       .memoryTypeIndex = memory_type,
+                    },
+                    NULL,
+                    &staging_mem);
+   vkBindBufferMemory(vc->device, staging, staging_mem, 0);
+
+   vkMapMemory(vc->device, staging_mem, 0, size, 0, &map);
+   memcpy(map, data, size);
+   vkUnmapMemory(vc->device, staging_mem);
+
+   vkAllocateCommandBuffers(vc->device,
+      &(VkCommandBufferAllocateInfo) {
+         .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+         .commandPool = vc->cmd_pool,
+         .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+         .commandBufferCount = 1,
+      },
+      &cmd_buffer);
+
+   vkBeginCommandBuffer(cmd_buffer,
+                        &(VkCommandBufferBeginInfo) {
+                           .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+                           .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+                        });
+
+   vkCmdCopyBuffer(cmd_buffer, staging, dst, 1,
+                   &(VkBufferCopy) {
+                      .srcOffset = 0,
+                      .dstOffset = 0,
+                      .size = size,
+                   });
+
+   /* Make the copy visible to every later read. */
+   vkCmdPipelineBarrier(cmd_buffer,
+                        VK_PIPELINE_STAGE_TRANSFER_BIT,
+                        dst_stage,
+                        0, 0, NULL, 1,
+                        &(VkBufferMemoryBarrier) {
+                           .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+                           .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+                           .dstAccessMask = dst_access,
+                           .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                           .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                           .buffer = dst,
+                           .offset = 0,
+                           .size = size,
+                        },
+                        0, NULL);
+
+   vkEndCommandBuffer(cmd_buffer);
+
+   vkCreateFence(vc->device,
+                 &(VkFenceCreateInfo) {
+                    .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+                 },
+                 NULL,
+                 &fence);
+
+   vkQueueSubmit(vc->queue, 1,
+      &(VkSubmitInfo) {
+         .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+         .commandBufferCount = 1,
+         .pCommandBuffers = &cmd_buffer,
+      }, fence);
+   vkWaitForFences(vc->device, 1, &fence, VK_TRUE, UINT64_MAX);
+
+   vkDestroyFence(vc->device, fence, NULL);
+   vkFreeCommandBuffers(vc->device, vc->cmd_pool, 1, &cmd_buffer);
+   vkDestroyBuffer(vc->device, staging, NULL);
+   vkFreeMemory(vc->device, staging_mem, NULL);
+}
+
+/* Lay the cubes out in a grid_size^3 lattice filling the space of the single
+ * cube, each spinning about its own axis. A single cube keeps the identity
+ * transform so the default scene is unchanged. */
+static void
+instance_params(struct vkcube *vc, uint32_t i, struct instance_params *p)
+{
+   uint32_t n = vc->grid_size;
+   float spacing = 2.0f / n;
+   uint32_t x = i % n, y = i / n % n, z = i / (n * n);
+
+   if (vc->instance_count == 1) {
+      *p = (struct instance_params) {
+         .scale = 1.0f,
+         .axis = { 1.0f, 0.0f, 0.0f },
+         .color = { 1.0f, 1.0f, 1.0f },
+      };
+      return;
+   }
+
+   *p = (struct instance_params) {
+      .translate = {
+         -1.0f + spacing * (x + 0.5f),
+         -1.0f + spacing * (y + 0.5f),
+         -1.0f + spacing * (z + 0.5f),
+      },
+      .scale = 0.35f * spacing,
+      .axis = { x + 1.0f, y + 1.0f, z + 1.0f },
+      .phase = 37.0f * i,
+      .color = { (x + 0.5f) / n, (y + 0.5f) / n, (z + 0.5f) / n },
+      .speed = 1.5f,
+   };
+}
+
+/* Lay instance_params() out as the arrays update_instances() feeds to
+ * esComposeBatch(), so the per-frame work is one batch call. */
+static void
+init_transforms(struct vkcube *vc)
+{
+   uint32_t n = vc->instance_count;
+   float *soa = malloc(13 * n * sizeof(float));
+
+   fail_if(!soa, "out of memory");
+   vc->instance_soa = soa;
+   vc->instance_xf = (ESTransformSoA) {
+      .tx = soa, .ty = soa + n, .tz = soa + 2 * n,
+      .ax = soa + 3 * n, .ay = soa + 4 * n, .az = soa + 5 * n,
+      .angle = soa + 6 * n,
+      .scale = soa + 7 * n,
+   };
+   vc->instance_angle = soa + 6 * n;
+   vc->instance_phase = soa + 8 * n;
+   vc->instance_speed = soa + 9 * n;
+   vc->instance_color = soa + 10 * n;
+
+   for (uint32_t i = 0; i < n; i++) {
+      struct instance_params p;
+
+      instance_params(vc, i, &p);
+      soa[i] = p.translate[0];
+      soa[n + i] = p.translate[1];
+      soa[2 * n + i] = p.translate[2];
+      soa[3 * n + i] = p.axis[0];
+      soa[4 * n + i] = p.axis[1];
+      soa[5 * n + i] = p.axis[2];
+      soa[7 * n + i] = p.scale;
+      vc->instance_phase[i] = p.phase;
+      vc->instance_speed[i] = p.speed;
+      memcpy(&vc->instance_color[3 * i], p.color, sizeof(p.color));
+   }
+}
+
+/* The compute pipeline and buffers of --gpu-animate. The instance slices
+ * move from vc->buffer to the device local vc->animate_buffer, and the
+ * parameters they are computed from are uploaded once. */
+static void
+init_animate(struct vkcube *vc)
 {
-    for (unsigned i = 0; (1u << i) <= allowed && i <= vc->memory_properties.memoryTypeCount; ++i) {
-        if ((allowed & (1u << i)) &&
-            (vc->memory_properties.memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) &&
-            (vc->memory_properties.memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT))
-            return i;
-    }
-    return -1;
+   VkDeviceSize params_size = vc->instance_count * sizeof(struct instance_params);
+   struct instance_params *params = malloc(params_size);
+
+   fail_if(!params, "out of memory");
+   for (uint32_t i = 0; i < vc->instance_count; i++)
+      instance_params(vc, i, &params[i]);
+
+   vkCreateBuffer(vc->device,
+                  &(VkBufferCreateInfo) {
+                     .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+                     .size = params_size,
+                     .usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                              VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                     .flags = 0
+                  },
+                  NULL,
+                  &vc->params_buffer);
+
+   vc->params_mem = allocate_buffer_memory(vc, vc->params_buffer, "instance parameters",
+                                           VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0);
+   upload_buffer(vc, vc->params_buffer, params, params_size,
+                 VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+   free(params);
+
+   vkCreateBuffer(vc->device,
+                  &(VkBufferCreateInfo) {
+                     .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+                     .size = MAX_NUM_IMAGES * vc->instance_stride,
+                     .usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                              VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+                     .flags = 0
+                  },
+                  NULL,
+                  &vc->animate_buffer);
+
+   vc->animate_mem = allocate_buffer_memory(vc, vc->animate_buffer, "instances",
+                                            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0);
+   vc->instance_buffer = vc->animate_buffer;
+
+   VkDescriptorSetLayout set_layout;
+   vkCreateDescriptorSetLayout(vc->device,
+                               &(VkDescriptorSetLayoutCreateInfo) {
+                                  .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+                                  .bindingCount = 2,
+                                  .pBindings = (VkDescriptorSetLayoutBinding[]) {
+                                     {
+                                        .binding = 0,
+                                        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                                        .descriptorCount = 1,
+                                        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+                                     },
+                                     {
+                                        .binding = 1,
+                                        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC,
+                                        .descriptorCount = 1,
+                                        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+                                     }
+                                  }
+                               },
+                               NULL,
+                               &set_layout);
+
+   vkCreatePipelineLayout(vc->device,
+                          &(VkPipelineLayoutCreateInfo) {
+                             .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+                             .setLayoutCount = 1,
+                             .pSetLayouts = &set_layout,
+                             .pushConstantRangeCount = 1,
+                             .pPushConstantRanges = &(VkPushConstantRange) {
+                                .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+                                .offset = 0,
+                                .size = sizeof(struct animate_constants),
+                             },
+                          },
+                          NULL,
+                          &vc->animate_pipeline_layout);
+
+   VkShaderModule cs_module;
+   vkCreateShaderModule(vc->device,
+                        &(VkShaderModuleCreateInfo) {
+                           .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+                           .codeSize = sizeof(cs_animate_spirv_source),
+                           .pCode = cs_animate_spirv_source,
+                        },
+                        NULL,
+                        &cs_module);
+
+   vkCreateComputePipelines(vc->device,
+      vc->pipeline_cache,
+      1,
+      &(VkComputePipelineCreateInfo) {
+         .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+         .stage = {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+            .stage = VK_SHADER_STAGE_COMPUTE_BIT,
+            .module = cs_module,
+            .pName = "main",
+         },
+         .layout = vc->animate_pipeline_layout,
+      },
+      NULL,
+      &vc->animate_pipeline);
+
+   vkAllocateDescriptorSets(vc->device,
+      &(VkDescriptorSetAllocateInfo) {
+         .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+         .descriptorPool = vc->desc_pool,
+         .descriptorSetCount = 1,
+         .pSetLayouts = &set_layout,
+      }, &vc->animate_descriptor_set);
+
+   vkUpdateDescriptorSets(vc->device, 2,
+                          (VkWriteDescriptorSet []) {
+                             {
+                                .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                                .dstSet = vc->animate_descriptor_set,
+                                .dstBinding = 0,
+                                .descriptorCount = 1,
+                                .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                                .pBufferInfo = &(VkDescriptorBufferInfo) {
+                                   .buffer = vc->params_buffer,
+                                   .offset = 0,
+                                   .range = params_size,
+                                }
+                             },
+                             {
+                                .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                                .dstSet = vc->animate_descriptor_set,
+                                .dstBinding = 1,
+                                .descriptorCount = 1,
+                                .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC,
+                                .pBufferInfo = &(VkDescriptorBufferInfo) {
+                                   .buffer = vc->animate_buffer,
+                                   .offset = 0,
+                                   .range = vc->instance_stride,
+                                }
+                             }
+                          },
+                          0, NULL);
+
+   vkDestroyDescriptorSetLayout(vc->device, set_layout, NULL);
+   vkDestroyShaderModule(vc->device, cs_module, NULL);
+}
+
+/* The compute pipeline and buffers of --gpu-cull. Runs once the instance
+ * and indirect slices are laid out, and after init_animate() so it culls
+ * the animated instances. */
+static void
+init_cull(struct vkcube *vc)
+{
+   vkCreateBuffer(vc->device,
+                  &(VkBufferCreateInfo) {
+                     .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+                     .size = MAX_NUM_IMAGES * vc->instance_stride,
+                     .usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                              VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+                     .flags = 0
+                  },
+                  NULL,
+                  &vc->cull_buffer);
+
+   vc->cull_mem = allocate_buffer_memory(vc, vc->cull_buffer, "visible instances",
+                                         VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0);
+
+   VkDescriptorSetLayout set_layout;
+   vkCreateDescriptorSetLayout(vc->device,
+                               &(VkDescriptorSetLayoutCreateInfo) {
+                                  .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+                                  .bindingCount = 3,
+                                  .pBindings = (VkDescriptorSetLayoutBinding[]) {
+                                     {
+                                        .binding = 0,
+                                        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC,
+                                        .descriptorCount = 1,
+                                        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+                                     },
+                                     {
+                                        .binding = 1,
+                                        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC,
+                                        .descriptorCount = 1,
+                                        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+                                     },
+                                     {
+                                        .binding = 2,
+                                        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC,
+                                        .descriptorCount = 1,
+                                        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+                                     }
+                                  }
+                               },
+                               NULL,
+                               &set_layout);
+
+   vkCreatePipelineLayout(vc->device,
+                          &(VkPipelineLayoutCreateInfo) {
+                             .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+                             .setLayoutCount = 1,
+                             .pSetLayouts = &set_layout,
+                             .pushConstantRangeCount = 1,
+                             .pPushConstantRanges = &(VkPushConstantRange) {
+                                .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+                                .offset = 0,
+                                .size = sizeof(struct cull_constants),
+                             },
+                          },
+                          NULL,
+                          &vc->cull_pipeline_layout);
+
+   VkShaderModule cs_module;
+   vkCreateShaderModule(vc->device,
+                        &(VkShaderModuleCreateInfo) {
+                           .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+                           .codeSize = sizeof(cs_cull_spirv_source),
+                           .pCode = cs_cull_spirv_source,
+                        },
+                        NULL,
+                        &cs_module);
+
+   vkCreateComputePipelines(vc->device,
+      vc->pipeline_cache,
+      1,
+      &(VkComputePipelineCreateInfo) {
+         .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+         .stage = {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+            .stage = VK_SHADER_STAGE_COMPUTE_BIT,
+            .module = cs_module,
+            .pName = "main",
+         },
+         .layout = vc->cull_pipeline_layout,
+      },
+      NULL,
+      &vc->cull_pipeline);
+
+   vkAllocateDescriptorSets(vc->device,
+      &(VkDescriptorSetAllocateInfo) {
+         .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+         .descriptorPool = vc->desc_pool,
+         .descriptorSetCount = 1,
+         .pSetLayouts = &set_layout,
+      }, &vc->cull_descriptor_set);
+
+   /* All three are addressed per buffer through dynamic offsets. */
+   vkUpdateDescriptorSets(vc->device, 3,
+                          (VkWriteDescriptorSet []) {
+                             {
+                                .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                                .dstSet = vc->cull_descriptor_set,
+                                .dstBinding = 0,
+                                .descriptorCount = 1,
+                                .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC,
+                                .pBufferInfo = &(VkDescriptorBufferInfo) {
+                                   .buffer = vc->instance_buffer,
+                                   .offset = 0,
+                                   .range = vc->instance_stride,
+                                }
+                             },
+                             {
+                                .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                                .dstSet = vc->cull_descriptor_set,
+                                .dstBinding = 1,
+                                .descriptorCount = 1,
+                                .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC,
+                                .pBufferInfo = &(VkDescriptorBufferInfo) {
+                                   .buffer = vc->cull_buffer,
+                                   .offset = 0,
+                                   .range = vc->instance_stride,
+                                }
+                             },
+                             {
+                                .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                                .dstSet = vc->cull_descriptor_set,
+                                .dstBinding = 2,
+                                .descriptorCount = 1,
+                                .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC,
+                                .pBufferInfo = &(VkDescriptorBufferInfo) {
+                                   .buffer = vc->buffer,
+                                   .offset = 0,
+                                   .range = sizeof(VkDrawIndexedIndirectCommand),
+                                }
+                             }
+                          },
+                          0, NULL);
+
+   vkDestroyDescriptorSetLayout(vc->device, set_layout, NULL);
+   vkDestroyShaderModule(vc->device, cs_module, NULL);
 }
 
 static void
@@ -62,7 +718,7 @@ init_cube(struct vkcube *vc)
                                   .bindingCount = 1,
                                   .pBindings = (VkDescriptorSetLayoutBinding[]) {
                                      {
-                                        .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+                                        .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
                                         .descriptorCount = 1,
                                         .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
                                         .pImmutableSamplers = NULL
@@ -77,59 +733,148 @@ init_cube(struct vkcube *vc)
                              .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
                              .setLayoutCount = 1,
                              .pSetLayouts = &set_layout,
+                             .pushConstantRangeCount = vc->push_constants ? 1 : 0,
+                             .pPushConstantRanges = &(VkPushConstantRange) {
+                                .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
+                                .offset = 0,
+                                .size = sizeof(struct push_constants),
+                             },
                           },
                           NULL,
                           &vc->pipeline_layout);
 
-   VkPipelineVertexInputStateCreateInfo vi_create_info = {
-      .sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
-      .vertexBindingDescriptionCount = 3,
-      .pVertexBindingDescriptions = (VkVertexInputBindingDescription[]) {
-         {
-            .binding = 0,
-            .stride = 3 * sizeof(float),
-            .inputRate = VK_VERTEX_INPUT_RATE_VERTEX
-         },
-         {
-            .binding = 1,
-            .stride = 3 * sizeof(float),
-            .inputRate = VK_VERTEX_INPUT_RATE_VERTEX
-         },
-         {
-            .binding = 2,
-            .stride = 3 * sizeof(float),
-            .inputRate = VK_VERTEX_INPUT_RATE_VERTEX
-         }
+   VkVertexInputBindingDescription vi_bindings[] = {
+      {
+         .binding = 0,
+         .stride = 3 * sizeof(float),
+         .inputRate = VK_VERTEX_INPUT_RATE_VERTEX
       },
-      .vertexAttributeDescriptionCount = 3,
-      .pVertexAttributeDescriptions = (VkVertexInputAttributeDescription[]) {
-         {
-            .location = 0,
-            .binding = 0,
-            .format = VK_FORMAT_R32G32B32_SFLOAT,
-            .offset = 0
-         },
-         {
-            .location = 1,
-            .binding = 1,
-            .format = VK_FORMAT_R32G32B32_SFLOAT,
-            .offset = 0
-         },
-         {
-            .location = 2,
-            .binding = 2,
-            .format = VK_FORMAT_R32G32B32_SFLOAT,
-            .offset = 0
-         }
+      {
+         .binding = 1,
+         .stride = 3 * sizeof(float),
+         .inputRate = VK_VERTEX_INPUT_RATE_VERTEX
+      },
+      {
+         .binding = 2,
+         .stride = 3 * sizeof(float),
+         .inputRate = VK_VERTEX_INPUT_RATE_VERTEX
+      },
+      {
+         .binding = 3,
+         .stride = sizeof(struct instance),
+         .inputRate = VK_VERTEX_INPUT_RATE_INSTANCE
+      }
+   };
+
+   VkVertexInputAttributeDescription vi_attributes[] = {
+      {
+         .location = 0,
+         .binding = 0,
+         .format = VK_FORMAT_R32G32B32_SFLOAT,
+         .offset = 0
+      },
+      {
+         .location = 1,
+         .binding = 1,
+         .format = VK_FORMAT_R32G32B32_SFLOAT,
+         .offset = 0
+      },
+      {
+         .location = 2,
+         .binding = 2,
+         .format = VK_FORMAT_R32G32B32_SFLOAT,
+         .offset = 0
+      },
+      {
+         .location = 3,
+         .binding = 3,
+         .format = VK_FORMAT_R32G32B32A32_SFLOAT,
+         .offset = offsetof(struct instance, model.m[0])
+      },
+      {
+         .location = 4,
+         .binding = 3,
+         .format = VK_FORMAT_R32G32B32A32_SFLOAT,
+         .offset = offsetof(struct instance, model.m[1])
+      },
+      {
+         .location = 5,
+         .binding = 3,
+         .format = VK_FORMAT_R32G32B32A32_SFLOAT,
+         .offset = offsetof(struct instance, model.m[2])
+      },
+      {
+         .location = 6,
+         .binding = 3,
+         .format = VK_FORMAT_R32G32B32A32_SFLOAT,
+         .offset = offsetof(struct instance, model.m[3])
+      },
+      {
+         .location = 7,
+         .binding = 3,
+         .format = VK_FORMAT_R32G32B32A32_SFLOAT,
+         .offset = offsetof(struct instance, color)
       }
    };
 
+   VkPipelineVertexInputStateCreateInfo vi_create_info = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
+      .vertexBindingDescriptionCount = 4,
+      .pVertexBindingDescriptions = vi_bindings,
+      .vertexAttributeDescriptionCount = 8,
+      .pVertexAttributeDescriptions = vi_attributes,
+   };
+
+   /* Interleaved: drop bindings 1 and 2 and fetch all three per-vertex
+    * attributes from binding 0. */
+   if (vc->interleaved) {
+      vi_bindings[0].stride = sizeof(struct vertex);
+      vi_bindings[1] = vi_bindings[3];
+      vi_create_info.vertexBindingDescriptionCount = 2;
+
+      vi_attributes[0].offset = offsetof(struct vertex, position);
+      vi_attributes[1].binding = 0;
+      vi_attributes[1].offset = offsetof(struct vertex, color);
+      vi_attributes[2].binding = 0;
+      vi_attributes[2].offset = offsetof(struct vertex, normal);
+   }
+
+   /* Compact: 16 bytes per vertex instead of 36. Vertex fetch from
+    * A2B10G10R10_SNORM_PACK32 is optional, so normals fall back to
+    * R8G8B8A8_SNORM, which is the same size. */
+   VkFormat normal_format = VK_FORMAT_A2B10G10R10_SNORM_PACK32;
+   VkFormatProperties normal_props;
+   vkGetPhysicalDeviceFormatProperties(vc->physical_device, normal_format,
+                                       &normal_props);
+   if (!(normal_props.bufferFeatures & VK_FORMAT_FEATURE_VERTEX_BUFFER_BIT))
+      normal_format = VK_FORMAT_R8G8B8A8_SNORM;
+
+   if (vc->compact_vertices) {
+      vi_attributes[0].format = VK_FORMAT_R16G16B16A16_SFLOAT;
+      vi_attributes[1].format = VK_FORMAT_R8G8B8A8_UNORM;
+      vi_attributes[2].format = normal_format;
+
+      if (vc->interleaved) {
+         vi_bindings[0].stride = sizeof(struct packed_vertex);
+         vi_attributes[0].offset = offsetof(struct packed_vertex, position);
+         vi_attributes[1].offset = offsetof(struct packed_vertex, color);
+         vi_attributes[2].offset = offsetof(struct packed_vertex, normal);
+      } else {
+         vi_bindings[0].stride = sizeof(uint16_t[4]);
+         vi_bindings[1].stride = sizeof(uint8_t[4]);
+         vi_bindings[2].stride = sizeof(uint32_t);
+      }
+   }
+
    VkShaderModule vs_module;
    vkCreateShaderModule(vc->device,
                         &(VkShaderModuleCreateInfo) {
                            .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
-                           .codeSize = sizeof(vs_spirv_source),
-                           .pCode = (uint32_t *)vs_spirv_source,
+                           .codeSize = vc->push_constants ?
+                                       sizeof(vs_push_spirv_source) :
+                                       sizeof(vs_spirv_source),
+                           .pCode = vc->push_constants ?
+                                    vs_push_spirv_source : vs_spirv_source,
                         },
                         NULL,
                         &vs_module);
@@ -145,7 +890,7 @@ init_cube(struct vkcube *vc)
                         &fs_module);
 
    vkCreateGraphicsPipelines(vc->device,
-      (VkPipelineCache) { VK_NULL_HANDLE },
+      vc->pipeline_cache,
       1,
       &(VkGraphicsPipelineCreateInfo) {
          .sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
@@ -167,7 +912,7 @@ init_cube(struct vkcube *vc)
          .pVertexInputState = &vi_create_info,
          .pInputAssemblyState = &(VkPipelineInputAssemblyStateCreateInfo) {
             .sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO,
-            .topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_STRIP,
+            .topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST,
             .primitiveRestartEnable = false,
          },
 
@@ -191,7 +936,10 @@ init_cube(struct vkcube *vc)
             .rasterizationSamples = 1,
          },
          .pDepthStencilState = &(VkPipelineDepthStencilStateCreateInfo) {
-            .sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO,
+            .depthTestEnable = vc->depth_format != VK_FORMAT_UNDEFINED,
+            .depthWriteEnable = vc->depth_format != VK_FORMAT_UNDEFINED,
+            .depthCompareOp = VK_COMPARE_OP_LESS,
          },
 
          .pColorBlendState = &(VkPipelineColorBlendStateCreateInfo) {
@@ -323,56 +1071,181 @@ init_cube(struct vkcube *vc)
       +0.0f, -1.0f, +0.0f  // down
    };
 
-   vc->vertex_offset = sizeof(struct ubo);
-   vc->colors_offset = vc->vertex_offset + sizeof(vVertices);
-   vc->normals_offset = vc->colors_offset + sizeof(vColors);
-   uint32_t mem_size = vc->normals_offset + sizeof(vNormals);
+   /* Each face is a quad of four vertices, split into two triangles with
+    * the same winding the triangle strips had. */
+   static const uint16_t vIndices[] = {
+       0,  1,  2,  2,  1,  3, // front
+       4,  5,  6,  6,  5,  7, // back
+       8,  9, 10, 10,  9, 11, // right
+      12, 13, 14, 14, 13, 15, // left
+      16, 17, 18, 18, 17, 19, // top
+      20, 21, 22, 22, 21, 23  // bottom
+   };
+
+   /* One UBO slice per swapchain image, so a frame can be recorded while
+    * the GPU is still reading the matrices of the previous ones. */
+   VkDeviceSize align = vc->properties.limits.minUniformBufferOffsetAlignment;
+   if (align == 0)
+      align = 1;
+   vc->ubo_stride = (sizeof(struct ubo) + align - 1) / align * align;
+
+   const uint32_t vertex_count = sizeof(vVertices) / sizeof(vVertices[0]) / 3;
+   vc->index_count = sizeof(vIndices) / sizeof(vIndices[0]);
+
+   /* Static geometry lives in its own device local buffer, laid out from
+    * offset 0 and uploaded once below. */
+   vc->vertex_offset = 0;
+   if (vc->compact_vertices && vc->interleaved) {
+      vc->colors_offset = vc->vertex_offset + offsetof(struct packed_vertex, color);
+      vc->normals_offset = vc->vertex_offset + offsetof(struct packed_vertex, normal);
+      vc->index_offset = vc->vertex_offset + vertex_count * sizeof(struct packed_vertex);
+   } else if (vc->compact_vertices) {
+      vc->colors_offset = vc->vertex_offset + vertex_count * sizeof(uint16_t[4]);
+      vc->normals_offset = vc->colors_offset + vertex_count * sizeof(uint8_t[4]);
+      vc->index_offset = vc->normals_offset + vertex_count * sizeof(uint32_t);
+   } else if (vc->interleaved) {
+      vc->colors_offset = vc->vertex_offset + offsetof(struct vertex, color);
+      vc->normals_offset = vc->vertex_offset + offsetof(struct vertex, normal);
+      vc->index_offset = vc->vertex_offset + vertex_count * sizeof(struct vertex);
+   } else {
+      vc->colors_offset = vc->vertex_offset + sizeof(vVertices);
+      vc->normals_offset = vc->colors_offset + sizeof(vColors);
+      vc->index_offset = vc->normals_offset + sizeof(vNormals);
+   }
+   VkDeviceSize geometry_size = vc->index_offset + sizeof(vIndices);
+
+   uint8_t *geometry = malloc(geometry_size);
+   fail_if(!geometry, "out of memory");
+   if (vc->compact_vertices) {
+      /* The strides match the vertex bindings set up above. */
+      uint32_t stride[3] = {
+         vi_bindings[0].stride,
+         vc->interleaved ? vi_bindings[0].stride : vi_bindings[1].stride,
+         vc->interleaved ? vi_bindings[0].stride : vi_bindings[2].stride,
+      };
+
+      memset(geometry, 0, vc->index_offset);
+      for (uint32_t i = 0; i < vertex_count; i++) {
+         uint16_t *position = (uint16_t *) (geometry + vc->vertex_offset + i * stride[0]);
+         uint8_t *color = geometry + vc->colors_offset + i * stride[1];
+         uint32_t *normal = (uint32_t *) (geometry + vc->normals_offset + i * stride[2]);
+
+         for (int c = 0; c < 3; c++) {
+            position[c] = float_to_half(vVertices[i * 3 + c]);
+            color[c] = pack_unorm8(vColors[i * 3 + c]);
+         }
+         position[3] = float_to_half(1.0f);
+         color[3] = 255;
+         *normal = pack_normal(&vNormals[i * 3], normal_format);
+      }
+   } else if (vc->interleaved) {
+      struct vertex *v = (struct vertex *) (geometry + vc->vertex_offset);
+
+      memset(v, 0, vertex_count * sizeof(*v));
+      for (uint32_t i = 0; i < vertex_count; i++) {
+         memcpy(v[i].position, &vVertices[i * 3], 3 * sizeof(float));
+         memcpy(v[i].color, &vColors[i * 3], 3 * sizeof(float));
+         memcpy(v[i].normal, &vNormals[i * 3], 3 * sizeof(float));
+      }
+   } else {
+      memcpy(geometry + vc->vertex_offset, vVertices, sizeof(vVertices));
+      memcpy(geometry + vc->colors_offset, vColors, sizeof(vColors));
+      memcpy(geometry + vc->normals_offset, vNormals, sizeof(vNormals));
+   }
+   memcpy(geometry + vc->index_offset, vIndices, sizeof(vIndices));
+
+   vkCreateBuffer(vc->device,
+                  &(VkBufferCreateInfo) {
+                     .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+                     .size = geometry_size,
+                     .usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT |
+                              VK_BUFFER_USAGE_INDEX_BUFFER_BIT |
+                              VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                     .flags = 0
+                  },
+                  NULL,
+                  &vc->geometry_buffer);
+
+   vc->geometry_mem = allocate_buffer_memory(vc, vc->geometry_buffer, "geometry",
+                                             VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0);
+   upload_buffer(vc, vc->geometry_buffer, geometry, geometry_size,
+                 VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+                 VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT);
+   free(geometry);
+
+   /* Instance data is rewritten every frame, so like the UBO it gets one
+    * slice per swapchain image. Both stay host visible; a device local
+    * type that is also host visible saves the GPU a trip over the bus.
+    * With --gpu-animate the instance slices are only written by the GPU
+    * and live in a device local buffer of their own instead. The slices
+    * are aligned for use as dynamic storage buffers by the compute passes,
+    * as are the indirect draw commands that follow with --gpu-cull. */
+   VkDeviceSize storage_align = vc->properties.limits.minStorageBufferOffsetAlignment;
+   if (storage_align < 16)
+      storage_align = 16;
+   vc->instance_stride = align_up(vc->instance_count * sizeof(struct instance),
+                                  storage_align);
+   VkDeviceSize mem_size = align_up(MAX_NUM_IMAGES * vc->ubo_stride, storage_align);
+   if (vc->gpu_animate) {
+      vc->instance_offset = 0;
+   } else {
+      vc->instance_offset = mem_size;
+      mem_size += (VkDeviceSize) MAX_NUM_IMAGES * vc->instance_stride;
+   }
+   if (vc->gpu_cull) {
+      vc->indirect_offset = mem_size;
+      vc->indirect_stride = align_up(sizeof(VkDrawIndexedIndirectCommand),
+                                     storage_align);
+      mem_size += MAX_NUM_IMAGES * vc->indirect_stride;
+   }
+
+   vc->grid_size = 1;
+   while (vc->grid_size * vc->grid_size * vc->grid_size < vc->instance_count)
+      vc->grid_size++;
 
    vkCreateBuffer(vc->device,
                   &(VkBufferCreateInfo) {
                      .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
                      .size = mem_size,
                      .usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT |
-                              VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+                              VK_BUFFER_USAGE_VERTEX_BUFFER_BIT |
+                              (vc->gpu_cull ?
+                               VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                               VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT : 0),
                      .flags = 0
                   },
                   NULL,
                   &vc->buffer);
+   vc->instance_buffer = vc->buffer;
 
-   VkMemoryRequirements reqs;
-   vkGetBufferMemoryRequirements(vc->device, vc->buffer, &reqs);
-
-   int memory_type = find_host_coherent_memory(vc, reqs.memoryTypeBits);
-   if (memory_type < 0)
-      fail("find_host_coherent_memory failed");
-
-   vkAllocateMemory(vc->device,
-                    &(VkMemoryAllocateInfo) {
-                       .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-                       .allocationSize = mem_size,
-                       .memoryTypeIndex = memory_type,
-                    },
-                    NULL,
-                    &vc->mem);
+   vc->mem = allocate_buffer_memory(vc, vc->buffer, "uniforms",
+                                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT |
+                                    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                    VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                                    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                    VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
 
    r = vkMapMemory(vc->device, vc->mem, 0, mem_size, 0, &vc->map);
    if (r != VK_SUCCESS)
       fail("vkMapMemory failed");
-   memcpy(vc->map + vc->vertex_offset, vVertices, sizeof(vVertices));
-   memcpy(vc->map + vc->colors_offset, vColors, sizeof(vColors));
-   memcpy(vc->map + vc->normals_offset, vNormals, sizeof(vNormals));
-
-   vkBindBufferMemory(vc->device, vc->buffer, vc->mem, 0);
 
    const VkDescriptorPoolCreateInfo create_info = {
       .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
       .pNext = NULL,
       .flags = 0,
-      .maxSets = 1,
-      .poolSizeCount = 1,
+      .maxSets = 3,
+      .poolSizeCount = 3,
       .pPoolSizes = (VkDescriptorPoolSize[]) {
          {
-            .type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+            .type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+            .descriptorCount = 1
+         },
+         {
+            .type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC,
+            .descriptorCount = 4
+         },
+         {
+            .type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
             .descriptorCount = 1
          },
       }
@@ -396,7 +1269,7 @@ init_cube(struct vkcube *vc)
                                 .dstBinding = 0,
                                 .dstArrayElement = 0,
                                 .descriptorCount = 1,
-                                .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+                                .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
                                 .pBufferInfo = &(VkDescriptorBufferInfo) {
                                    .buffer = vc->buffer,
                                    .offset = 0,
@@ -409,41 +1282,122 @@ init_cube(struct vkcube *vc)
    vkDestroyDescriptorSetLayout(vc->device, set_layout, NULL);
    vkDestroyShaderModule(vc->device, vs_module, NULL);
    vkDestroyShaderModule(vc->device, fs_module, NULL);
+
+   if (vc->gpu_animate)
+      init_animate(vc);
+   else
+      init_transforms(vc);
+   if (vc->gpu_cull)
+      init_cull(vc);
 }
 
+/* Called after the buffer's fence has signalled, so the results of its
+ * previous frame are available and this never blocks. Queries 2 and 3 are
+ * only written when there are compute passes. */
 static void
-render_cube(struct vkcube *vc, struct vkcube_buffer *b)
+read_timestamps(struct vkcube *vc, struct vkcube_buffer *b)
 {
-   struct ubo ubo;
-   struct timeval tv;
-   uint64_t t;
+   uint64_t ts[4];
+   uint32_t count = vc->gpu_animate || vc->gpu_cull ? 4 : 2;
+   VkResult r;
 
-   gettimeofday(&tv, NULL);
+   b->query_pending = false;
+   r = vkGetQueryPoolResults(vc->device, b->query_pool, 0, count,
+                             count * sizeof(ts[0]), ts,
+                             sizeof(ts[0]), VK_QUERY_RESULT_64_BIT);
+   if (r != VK_SUCCESS)
+      return;
 
-   t = ((tv.tv_sec * 1000 + tv.tv_usec / 1000) -
-        (vc->start_tv.tv_sec * 1000 + vc->start_tv.tv_usec / 1000)) / 5;
+   uint64_t mask = vc->timestamp_valid_bits >= 64 ?
+      UINT64_MAX : (1ull << vc->timestamp_valid_bits) - 1;
+   double period = vc->properties.limits.timestampPeriod;
 
-   esMatrixLoadIdentity(&ubo.modelview);
-   esTranslate(&ubo.modelview, 0.0f, 0.0f, -8.0f);
-   esRotate(&ubo.modelview, 45.0f + (0.25f * t), 1.0f, 0.0f, 0.0f);
-   esRotate(&ubo.modelview, 45.0f - (0.5f * t), 0.0f, 1.0f, 0.0f);
-   esRotate(&ubo.modelview, 10.0f + (0.15f * t), 0.0f, 0.0f, 1.0f);
+   bench_gpu_sample(vc, ((ts[1] - ts[0]) & mask) * period);
+   if (count == 4)
+      bench_gpu_compute_sample(vc, ((ts[3] - ts[2]) & mask) * period);
+}
 
-   float aspect = (float) vc->height / (float) vc->width;
-   ESMatrix projection;
-   esMatrixLoadIdentity(&projection);
-   esFrustum(&projection, -2.8f, +2.8f, -2.8f * aspect, +2.8f * aspect, 6.0f, 10.0f);
+/* Each buffer owns the UBO slice at a fixed offset, so the dynamic offset
+ * recorded into its command buffer never changes. */
+static uint32_t
+ubo_slice(struct vkcube *vc, struct vkcube_buffer *b)
+{
+   return (b - vc->buffers) * vc->ubo_stride;
+}
 
-   esMatrixLoadIdentity(&ubo.modelviewprojection);
-   esMatrixMultiply(&ubo.modelviewprojection, &ubo.modelview, &projection);
+static VkDeviceSize
+instance_slice(struct vkcube *vc, struct vkcube_buffer *b)
+{
+   return vc->instance_offset + (VkDeviceSize) (b - vc->buffers) * vc->instance_stride;
+}
 
-   /* The mat3 normalMatrix is laid out as 3 vec4s. */
-   memcpy(ubo.normal, &ubo.modelview, sizeof ubo.normal);
+/* Visible instances in vc->cull_buffer and the indirect draw in vc->buffer
+ * written by the cull pass of buffer b. */
+static VkDeviceSize
+cull_slice(struct vkcube *vc, struct vkcube_buffer *b)
+{
+   return (VkDeviceSize) (b - vc->buffers) * vc->instance_stride;
+}
 
-   memcpy(vc->map, &ubo, sizeof(ubo));
+static VkDeviceSize
+indirect_slice(struct vkcube *vc, struct vkcube_buffer *b)
+{
+   return vc->indirect_offset + (VkDeviceSize) (b - vc->buffers) * vc->indirect_stride;
+}
 
-   vkWaitForFences(vc->device, 1, &b->fence, VK_TRUE, UINT64_MAX);
-   vkResetFences(vc->device, 1, &b->fence);
+/* Gribb and Hartmann: the frustum planes as combinations of the rows of
+ * the modelview-projection, so they apply directly to the positions the
+ * instance model matrices produce. Normalized, a plane gives the signed
+ * distance. esFrustum maps depth to [0, w], so the near plane is z >= 0. */
+static void
+frustum_planes(const ESMatrix *mvp, float planes[6][4])
+{
+   for (int c = 0; c < 4; c++) {
+      planes[0][c] = mvp->m[c][3] + mvp->m[c][0];
+      planes[1][c] = mvp->m[c][3] - mvp->m[c][0];
+      planes[2][c] = mvp->m[c][3] + mvp->m[c][1];
+      planes[3][c] = mvp->m[c][3] - mvp->m[c][1];
+      planes[4][c] = mvp->m[c][2];
+      planes[5][c] = mvp->m[c][3] - mvp->m[c][2];
+   }
+
+   for (int i = 0; i < 6; i++) {
+      float len = sqrtf(planes[i][0] * planes[i][0] +
+                        planes[i][1] * planes[i][1] +
+                        planes[i][2] * planes[i][2]);
+      for (int c = 0; c < 4; c++)
+         planes[i][c] /= len;
+   }
+}
+
+/* The CPU side of instance_params(); vkcube-animate.comp does the same
+ * with --gpu-animate. esComposeBatch() gives the same matrices as
+ * esTranslate, esRotate and esScale one cube at a time, and spreads large
+ * grids over the --transform-threads workers. */
+static void
+update_instances(struct vkcube *vc, struct instance *instances, float t)
+{
+   for (uint32_t i = 0; i < vc->instance_count; i++)
+      vc->instance_angle[i] = vc->instance_speed[i] * t + vc->instance_phase[i];
+
+   esComposeBatch(&instances[0].model, sizeof(struct instance),
+                  &vc->instance_xf, vc->instance_count);
+
+   for (uint32_t i = 0; i < vc->instance_count; i++) {
+      memcpy(instances[i].color, &vc->instance_color[3 * i], 3 * sizeof(float));
+      instances[i].color[3] = 1.0f;
+   }
+}
+
+static void
+record_cube(struct vkcube *vc, struct vkcube_buffer *b,
+            const struct push_constants *pc,
+            const struct animate_constants *animate,
+            const struct cull_constants *cull)
+{
+   uint32_t ubo_offset = ubo_slice(vc, b);
+   VkBuffer instance_buffer = cull ? vc->cull_buffer : vc->instance_buffer;
+   VkDeviceSize instance_offset = cull ? cull_slice(vc, b) : instance_slice(vc, b);
 
    vkBeginCommandBuffer(b->cmd_buffer,
                         &(VkCommandBufferBeginInfo) {
@@ -451,38 +1405,136 @@ render_cube(struct vkcube *vc, struct vkcube_buffer *b)
                            .flags = 0
                         });
 
+   if (b->query_pool)
+      vkCmdResetQueryPool(b->cmd_buffer, b->query_pool, 0, 4);
+
+   if (b->query_pool && (animate || cull))
+      vkCmdWriteTimestamp(b->cmd_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                          b->query_pool, 2);
+
+   if (animate) {
+      uint32_t animate_offset = instance_slice(vc, b);
+
+      vkCmdBindPipeline(b->cmd_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                        vc->animate_pipeline);
+      vkCmdBindDescriptorSets(b->cmd_buffer,
+                              VK_PIPELINE_BIND_POINT_COMPUTE,
+                              vc->animate_pipeline_layout,
+                              0, 1,
+                              &vc->animate_descriptor_set, 1, &animate_offset);
+      vkCmdPushConstants(b->cmd_buffer, vc->animate_pipeline_layout,
+                         VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(*animate), animate);
+      vkCmdDispatch(b->cmd_buffer, (vc->instance_count + 63) / 64, 1, 1);
+
+      /* Read by the cull pass or straight by the vertex input. */
+      vkCmdPipelineBarrier(b->cmd_buffer,
+                           VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                           VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT |
+                           VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+                           0, 1,
+                           &(VkMemoryBarrier) {
+                              .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+                              .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+                              .dstAccessMask = VK_ACCESS_SHADER_READ_BIT |
+                                               VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT,
+                           },
+                           0, NULL, 0, NULL);
+   }
+
+   if (cull) {
+      uint32_t cull_offsets[] = {
+         instance_slice(vc, b),
+         cull_slice(vc, b),
+         indirect_slice(vc, b),
+      };
+
+      vkCmdBindPipeline(b->cmd_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                        vc->cull_pipeline);
+      vkCmdBindDescriptorSets(b->cmd_buffer,
+                              VK_PIPELINE_BIND_POINT_COMPUTE,
+                              vc->cull_pipeline_layout,
+                              0, 1,
+                              &vc->cull_descriptor_set, 3, cull_offsets);
+      vkCmdPushConstants(b->cmd_buffer, vc->cull_pipeline_layout,
+                         VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(*cull), cull);
+      vkCmdDispatch(b->cmd_buffer, (vc->instance_count + 63) / 64, 1, 1);
+
+      vkCmdPipelineBarrier(b->cmd_buffer,
+                           VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                           VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT |
+                           VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+                           0, 1,
+                           &(VkMemoryBarrier) {
+                              .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+                              .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+                              .dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT |
+                                               VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT,
+                           },
+                           0, NULL, 0, NULL);
+   }
+
+   if (b->query_pool && (animate || cull))
+      vkCmdWriteTimestamp(b->cmd_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                          b->query_pool, 3);
+
+   /* Only the render pass is timed. A TOP_OF_PIPE timestamp does not wait
+    * for the compute passes before it, so after them the start is taken
+    * once they have finished. */
+   if (b->query_pool)
+      vkCmdWriteTimestamp(b->cmd_buffer,
+                          animate || cull ? VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT :
+                                            VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                          b->query_pool, 0);
+
    vkCmdBeginRenderPass(b->cmd_buffer,
                         &(VkRenderPassBeginInfo) {
                            .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
                            .renderPass = vc->render_pass,
                            .framebuffer = b->framebuffer,
                            .renderArea = { { 0, 0 }, { vc->width, vc->height } },
-                           .clearValueCount = 1,
+                           .clearValueCount = 2,
                            .pClearValues = (VkClearValue []) {
-                              { .color = { .float32 = { 0.2f, 0.2f, 0.2f, 1.0f } } }
+                              { .color = { .float32 = { 0.2f, 0.2f, 0.2f, 1.0f } } },
+                              { .depthStencil = { 1.0f, 0 } },
                            }
                         },
                         VK_SUBPASS_CONTENTS_INLINE);
 
-   vkCmdBindVertexBuffers(b->cmd_buffer, 0, 3,
-                          (VkBuffer[]) {
-                             vc->buffer,
-                             vc->buffer,
-                             vc->buffer
-                          },
-                          (VkDeviceSize[]) {
-                             vc->vertex_offset,
-                             vc->colors_offset,
-                             vc->normals_offset
-                           });
+   if (vc->interleaved) {
+      vkCmdBindVertexBuffers(b->cmd_buffer, 0, 1, &vc->geometry_buffer,
+                             (VkDeviceSize[]) { vc->vertex_offset });
+      vkCmdBindVertexBuffers(b->cmd_buffer, 3, 1, &instance_buffer,
+                             (VkDeviceSize[]) { instance_offset });
+   } else {
+      vkCmdBindVertexBuffers(b->cmd_buffer, 0, 4,
+                             (VkBuffer[]) {
+                                vc->geometry_buffer,
+                                vc->geometry_buffer,
+                                vc->geometry_buffer,
+                                instance_buffer
+                             },
+                             (VkDeviceSize[]) {
+                                vc->vertex_offset,
+                                vc->colors_offset,
+                                vc->normals_offset,
+                                instance_offset
+                              });
+   }
+
+   vkCmdBindIndexBuffer(b->cmd_buffer, vc->geometry_buffer, vc->index_offset,
+                        VK_INDEX_TYPE_UINT16);
 
    vkCmdBindPipeline(b->cmd_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, vc->pipeline);
 
-   vkCmdBindDescriptorSets(b->cmd_buffer,
-                           VK_PIPELINE_BIND_POINT_GRAPHICS,
-                           vc->pipeline_layout,
-                           0, 1,
-                           &vc->descriptor_set, 0, NULL);
+   if (pc)
+      vkCmdPushConstants(b->cmd_buffer, vc->pipeline_layout,
+                         VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(*pc), pc);
+   else
+      vkCmdBindDescriptorSets(b->cmd_buffer,
+                              VK_PIPELINE_BIND_POINT_GRAPHICS,
+                              vc->pipeline_layout,
+                              0, 1,
+                              &vc->descriptor_set, 1, &ubo_offset);
 
    const VkViewport viewport = {
       .x = 0,
@@ -500,27 +1552,138 @@ render_cube(struct vkcube *vc, struct vkcube_buffer *b)
    };
    vkCmdSetScissor(b->cmd_buffer, 0, 1, &scissor);
 
-   vkCmdDraw(b->cmd_buffer, 4, 1, 0, 0);
-   vkCmdDraw(b->cmd_buffer, 4, 1, 4, 0);
-   vkCmdDraw(b->cmd_buffer, 4, 1, 8, 0);
-   vkCmdDraw(b->cmd_buffer, 4, 1, 12, 0);
-   vkCmdDraw(b->cmd_buffer, 4, 1, 16, 0);
-   vkCmdDraw(b->cmd_buffer, 4, 1, 20, 0);
+   if (cull)
+      vkCmdDrawIndexedIndirect(b->cmd_buffer, vc->buffer, indirect_slice(vc, b),
+                               1, 0);
+   else
+      vkCmdDrawIndexed(b->cmd_buffer, vc->index_count, vc->instance_count, 0, 0, 0);
 
    vkCmdEndRenderPass(b->cmd_buffer);
 
+   /* The visible count is read back once the fence signals. */
+   if (cull)
+      vkCmdPipelineBarrier(b->cmd_buffer,
+                           VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                           VK_PIPELINE_STAGE_HOST_BIT,
+                           0, 1,
+                           &(VkMemoryBarrier) {
+                              .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+                              .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+                              .dstAccessMask = VK_ACCESS_HOST_READ_BIT,
+                           },
+                           0, NULL, 0, NULL);
+
+   if (b->query_pool)
+      vkCmdWriteTimestamp(b->cmd_buffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                          b->query_pool, 1);
+
    vkEndCommandBuffer(b->cmd_buffer);
+}
+
+static void
+render_cube(struct vkcube *vc, struct vkcube_buffer *b)
+{
+   struct ubo ubo;
+
+   /* The animation advances one step per 5 ms. */
+   float t = frame_clock_next(&vc->clock) / 5e6;
+
+   /* The x, y and z spins as one quaternion, so the modelview takes one
+    * 3x3 multiply instead of three esRotate matrix multiplies. */
+   ESQuaternion spin;
+   esQuaternionFromEuler(&spin, 45.0f + (0.25f * t), 45.0f - (0.5f * t),
+                         10.0f + (0.15f * t));
+
+   esMatrixLoadIdentity(&ubo.modelview);
+   esTranslate(&ubo.modelview, 0.0f, 0.0f, -8.0f);
+   esRotateQuaternion(&ubo.modelview, &spin);
+
+   float aspect = (float) vc->height / (float) vc->width;
+   ESMatrix projection;
+   esMatrixLoadIdentity(&projection);
+   esFrustum(&projection, -2.8f, +2.8f, -2.8f * aspect, +2.8f * aspect, 6.0f, 10.0f);
+
+   esMatrixLoadIdentity(&ubo.modelviewprojection);
+   esMatrixMultiply(&ubo.modelviewprojection, &ubo.modelview, &projection);
+
+   /* The mat3 normalMatrix is laid out as 3 vec4s. */
+   memcpy(ubo.normal, &ubo.modelview, sizeof ubo.normal);
+
+   struct push_constants pc;
+   if (vc->push_constants) {
+      pc.modelviewprojection = ubo.modelviewprojection;
+      memcpy(pc.normal, ubo.normal, sizeof pc.normal);
+      for (int i = 0; i < 3; i++)
+         pc.normal[i * 4 + 3] = ubo.modelview.m[3][i];
+   }
+
+   struct animate_constants animate = {
+      .t = t,
+      .count = vc->instance_count,
+   };
+
+   struct cull_constants cull;
+   if (vc->gpu_cull) {
+      frustum_planes(&ubo.modelviewprojection, cull.planes);
+      cull.count = vc->instance_count;
+   }
+
+   /* The slice belongs to this buffer; once its fence has signalled the GPU
+    * is done reading the previous contents. */
+   uint32_t ubo_offset = ubo_slice(vc, b);
+
+   vkWaitForFences(vc->device, 1, &b->fence, VK_TRUE, UINT64_MAX);
+   vkResetFences(vc->device, 1, &b->fence);
+
+   if (b->query_pending)
+      read_timestamps(vc, b);
+
+   if (!vc->gpu_animate)
+      update_instances(vc, vc->map + instance_slice(vc, b), t);
+
+   /* The cull pass counts the visible instances up from zero. */
+   if (vc->gpu_cull) {
+      VkDrawIndexedIndirectCommand *draw = vc->map + indirect_slice(vc, b);
+
+      if (b->cull_pending)
+         bench_cull_sample(vc, draw->instanceCount);
+      *draw = (VkDrawIndexedIndirectCommand) {
+         .indexCount = vc->index_count,
+         .instanceCount = 0,
+      };
+      b->cull_pending = true;
+   }
+
+   if (vc->push_constants) {
+      record_cube(vc, b, &pc, vc->gpu_animate ? &animate : NULL,
+                  vc->gpu_cull ? &cull : NULL);
+   } else {
+      memcpy(vc->map + ubo_offset, &ubo, sizeof(ubo));
+
+      /* The command buffer only depends on the buffer and the swapchain
+       * size, so with prerecord it is reused until the buffer is destroyed. */
+      if (!vc->prerecord || !b->recorded) {
+         record_cube(vc, b, NULL, vc->gpu_animate ? &animate : NULL,
+                     vc->gpu_cull ? &cull : NULL);
+         b->recorded = true;
+      }
+   }
+
+   if (b->query_pool)
+      b->query_pending = true;
 
    vkQueueSubmit(vc->queue, 1,
       &(VkSubmitInfo) {
          .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-         .waitSemaphoreCount = 1,
-         .pWaitSemaphores = &vc->semaphore,
+         .waitSemaphoreCount = b->acquire_semaphore ? 1 : 0,
+         .pWaitSemaphores = &b->acquire_semaphore,
          .pWaitDstStageMask = (VkPipelineStageFlags []) {
             VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
          },
          .commandBufferCount = 1,
          .pCommandBuffers = &b->cmd_buffer,
+         .signalSemaphoreCount = b->render_semaphore ? 1 : 0,
+         .pSignalSemaphores = &b->render_semaphore,
       }, b->fence);
 }
 
@@ -41,13 +41,187 @@
 //  Includes
 //
 #include "esUtil.h"
+#include "esTransformSimd.h"
 #include <math.h>
+#include <stdlib.h>
 #include <string.h>
 
 #define PI 3.1415926535897932384626433832795f
 
+//
+// The same sums as esMatrixMultiplyScalar. result is a local in the only
+// caller, so nothing it reads can change under it and restrict lets the
+// compiler keep srcB in registers.
+//
+static inline void
+esRowsMultiplyScalar(ESMatrix *restrict result, const ESMatrix *restrict srcA, const ESMatrix *restrict srcB)
+{
+    int i, j;
+
+    for (i = 0; i < 4; i++)
+        for (j = 0; j < 4; j++)
+            result->m[i][j] = (srcA->m[i][0] * srcB->m[0][j]) +
+                              (srcA->m[i][1] * srcB->m[1][j]) +
+                              (srcA->m[i][2] * srcB->m[2][j]) +
+                              (srcA->m[i][3] * srcB->m[3][j]);
+}
+
+static void
+esMatrixMultiplyBatchScalar(ESMatrix *result, const ESMatrix *srcA, const ESMatrix *srcB, int bStep, int count)
+{
+    ESMatrix b, tmp;
+    int i;
+
+    if (bStep == 0)
+    {
+        b = *srcB;
+        for (i = 0; i < count; i++)
+        {
+            esRowsMultiplyScalar(&tmp, &srcA[i], &b);
+            result[i] = tmp;
+        }
+        return;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        esRowsMultiplyScalar(&tmp, &srcA[i], &srcB[i * bStep]);
+        result[i] = tmp;
+    }
+}
+
+static const ESKernelFuncs esKernelScalar = {
+    .multiply = esMatrixMultiplyScalar,
+    .translate = esTranslateScalar,
+    .scale = esScaleScalar,
+    .multiplyBatch = esMatrixMultiplyBatchScalar,
+};
+
+static const char *esKernelNames[ES_KERNEL_COUNT] = {
+    [ES_KERNEL_SCALAR] = "scalar",
+    [ES_KERNEL_SSE] = "sse",
+    [ES_KERNEL_AVX2] = "avx2",
+    [ES_KERNEL_NEON] = "neon",
+};
+
+static ESKernel esKernel = ES_KERNEL_SCALAR;
+static const ESKernelFuncs *esFuncs = &esKernelScalar;
+
+static const ESKernelFuncs *
+esKernelFuncs(ESKernel kernel)
+{
+    switch (kernel)
+    {
+#ifdef ES_HAVE_SSE
+    case ES_KERNEL_SSE:
+        return &esKernelSSE;
+#endif
+#ifdef ES_HAVE_AVX2
+    case ES_KERNEL_AVX2:
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") ?
+               &esKernelAVX2 : NULL;
+#endif
+#ifdef ES_HAVE_NEON
+    case ES_KERNEL_NEON:
+        return &esKernelNEON;
+#endif
+    case ES_KERNEL_SCALAR:
+        return &esKernelScalar;
+    default:
+        return NULL;
+    }
+}
+
+int ESUTIL_API
+esKernelSupported(ESKernel kernel)
+{
+    return esKernelFuncs(kernel) != NULL;
+}
+
+int ESUTIL_API
+esSetKernel(ESKernel kernel)
+{
+    const ESKernelFuncs *funcs = esKernelFuncs(kernel);
+
+    if (!funcs)
+        return FALSE;
+
+    esKernel = kernel;
+    esFuncs = funcs;
+    return TRUE;
+}
+
+ESKernel ESUTIL_API
+esGetKernel(void)
+{
+    return esKernel;
+}
+
+const ESKernelFuncs *
+esKernelCurrent(void)
+{
+    return esFuncs;
+}
+
+const char * ESUTIL_API
+esKernelName(ESKernel kernel)
+{
+    return kernel < ES_KERNEL_COUNT ? esKernelNames[kernel] : "unknown";
+}
+
+//
+// Pick the fastest supported kernel before main() runs, so the matrix
+// functions never race on the choice. ES_KERNEL overrides it.
+//
+__attribute__((constructor))
+static void
+esKernelInit(void)
+{
+    const char *name = getenv("ES_KERNEL");
+    int k;
+
+#ifdef ES_HAVE_AVX2
+    // This can run before libgcc's own constructor has filled in the
+    // CPU features that __builtin_cpu_supports() reads.
+    __builtin_cpu_init();
+#endif
+
+    if (name)
+    {
+        for (k = 0; k < ES_KERNEL_COUNT; k++)
+        {
+            if (strcmp(name, esKernelNames[k]) == 0 && esSetKernel(k))
+                return;
+        }
+    }
+
+    for (k = ES_KERNEL_COUNT - 1; k > ES_KERNEL_SCALAR; k--)
+    {
+        if (esSetKernel(k))
+            return;
+    }
+}
+
 void ESUTIL_API
 esScale(ESMatrix *result, float sx, float sy, float sz)
+{
+    esFuncs->scale(result, sx, sy, sz);
+}
+
+void ESUTIL_API
+esTranslate(ESMatrix *result, float tx, float ty, float tz)
+{
+    esFuncs->translate(result, tx, ty, tz);
+}
+
+void ESUTIL_API
+esMatrixMultiply(ESMatrix *result, ESMatrix *srcA, ESMatrix *srcB)
+{
+    esFuncs->multiply(result, srcA, srcB);
+}
+
+void ESUTIL_API
+esScaleScalar(ESMatrix *result, float sx, float sy, float sz)
 {
     result->m[0][0] *= sx;
     result->m[0][1] *= sx;
@@ -66,7 +240,7 @@ esScale(ESMatrix *result, float sx, float sy, float sz)
 }
 
 void ESUTIL_API
-esTranslate(ESMatrix *result, float tx, float ty, float tz)
+esTranslateScalar(ESMatrix *result, float tx, float ty, float tz)
 {
     result->m[3][0] += (result->m[0][0] * tx + result->m[1][0] * ty + result->m[2][0] * tz);
     result->m[3][1] += (result->m[0][1] * tx + result->m[1][1] * ty + result->m[2][1] * tz);
@@ -192,7 +366,7 @@ esOrtho(ESMatrix *result, float left, float right, float bottom, float top, floa
 
 
 void ESUTIL_API
-esMatrixMultiply(ESMatrix *result, ESMatrix *srcA, ESMatrix *srcB)
+esMatrixMultiplyScalar(ESMatrix *result, ESMatrix *srcA, ESMatrix *srcB)
 {
     ESMatrix    tmp;
     int         i;
@@ -233,3 +407,162 @@ esMatrixLoadIdentity(ESMatrix *result)
     result->m[3][3] = 1.0f;
 }
 
+
+void ESUTIL_API
+esQuaternionFromAxisAngle(ESQuaternion *result, float angle, float x, float y, float z)
+{
+    float mag = sqrtf(x * x + y * y + z * z);
+    float halfAngle = angle * PI / 360.0f;
+    float s;
+
+    if (mag <= 0.0f)
+    {
+        *result = (ESQuaternion) { 0.0f, 0.0f, 0.0f, 1.0f };
+        return;
+    }
+
+    s = sinf(halfAngle) / mag;
+    result->x = x * s;
+    result->y = y * s;
+    result->z = z * s;
+    result->w = cosf(halfAngle);
+}
+
+void ESUTIL_API
+esQuaternionFromEuler(ESQuaternion *result, float x, float y, float z)
+{
+    float hx = x * PI / 360.0f, hy = y * PI / 360.0f, hz = z * PI / 360.0f;
+    float sx = sinf(hx), cx = cosf(hx);
+    float sy = sinf(hy), cy = cosf(hy);
+    float sz = sinf(hz), cz = cosf(hz);
+
+    // qz * qy * qx with the zeros of the single-axis quaternions folded out
+    result->x = cz * cy * sx - sz * sy * cx;
+    result->y = cz * sy * cx + sz * cy * sx;
+    result->z = sz * cy * cx - cz * sy * sx;
+    result->w = cz * cy * cx + sz * sy * sx;
+}
+
+void ESUTIL_API
+esQuaternionMultiply(ESQuaternion *result, const ESQuaternion *a, const ESQuaternion *b)
+{
+    ESQuaternion tmp;
+
+    tmp.x = a->w * b->x + a->x * b->w + a->y * b->z - a->z * b->y;
+    tmp.y = a->w * b->y - a->x * b->z + a->y * b->w + a->z * b->x;
+    tmp.z = a->w * b->z + a->x * b->y - a->y * b->x + a->z * b->w;
+    tmp.w = a->w * b->w - a->x * b->x - a->y * b->y - a->z * b->z;
+    *result = tmp;
+}
+
+void ESUTIL_API
+esQuaternionNormalize(ESQuaternion *q)
+{
+    float mag = sqrtf(q->x * q->x + q->y * q->y + q->z * q->z + q->w * q->w);
+
+    if (mag > 0.0f)
+    {
+        q->x /= mag;
+        q->y /= mag;
+        q->z /= mag;
+        q->w /= mag;
+    }
+}
+
+void ESUTIL_API
+esQuaternionSlerp(ESQuaternion *result, const ESQuaternion *a, const ESQuaternion *b, float t)
+{
+    float cosTheta = a->x * b->x + a->y * b->y + a->z * b->z + a->w * b->w;
+    float sign = 1.0f;
+    float wa, wb;
+
+    // q and -q are the same rotation; take the one nearer a
+    if (cosTheta < 0.0f)
+    {
+        cosTheta = -cosTheta;
+        sign = -1.0f;
+    }
+
+    if (cosTheta > 0.9995f)
+    {
+        // Nearly parallel: sin(theta) is too small to divide by, and a
+        // normalized lerp is indistinguishable.
+        wa = 1.0f - t;
+        wb = t;
+    }
+    else
+    {
+        float theta = acosf(cosTheta);
+        float sinTheta = sinf(theta);
+
+        wa = sinf((1.0f - t) * theta) / sinTheta;
+        wb = sinf(t * theta) / sinTheta;
+    }
+
+    wb *= sign;
+    result->x = wa * a->x + wb * b->x;
+    result->y = wa * a->y + wb * b->y;
+    result->z = wa * a->z + wb * b->z;
+    result->w = wa * a->w + wb * b->w;
+    esQuaternionNormalize(result);
+}
+
+// The upper 3x3 of the matrix esRotate builds as rotMat. Dividing by the
+// squared length keeps it a rotation even if q has drifted from unit length.
+static void
+esQuaternionRotMat(float r[3][3], const ESQuaternion *q)
+{
+    float n = q->x * q->x + q->y * q->y + q->z * q->z + q->w * q->w;
+    float s = n > 0.0f ? 2.0f / n : 0.0f;
+    float xx = q->x * q->x * s, yy = q->y * q->y * s, zz = q->z * q->z * s;
+    float xy = q->x * q->y * s, yz = q->y * q->z * s, zx = q->z * q->x * s;
+    float wx = q->w * q->x * s, wy = q->w * q->y * s, wz = q->w * q->z * s;
+
+    r[0][0] = 1.0f - (yy + zz);
+    r[0][1] = xy - wz;
+    r[0][2] = zx + wy;
+
+    r[1][0] = xy + wz;
+    r[1][1] = 1.0f - (xx + zz);
+    r[1][2] = yz - wx;
+
+    r[2][0] = zx - wy;
+    r[2][1] = yz + wx;
+    r[2][2] = 1.0f - (xx + yy);
+}
+
+void ESUTIL_API
+esQuaternionToMatrix(ESMatrix *result, const ESQuaternion *q)
+{
+    float r[3][3];
+    int i;
+
+    esQuaternionRotMat(r, q);
+    esMatrixLoadIdentity(result);
+    for (i = 0; i < 3; i++)
+    {
+        result->m[i][0] = r[i][0];
+        result->m[i][1] = r[i][1];
+        result->m[i][2] = r[i][2];
+    }
+}
+
+void ESUTIL_API
+esRotateQuaternion(ESMatrix *result, const ESQuaternion *q)
+{
+    float r[3][3];
+    ESMatrix tmp;
+    int i, j;
+
+    // rotMat's last row and column are those of the identity, so row 3 of
+    // the product is row 3 of result and the rest needs only 3x3x4
+    // multiplies instead of esMatrixMultiply's 64.
+    esQuaternionRotMat(r, q);
+    for (i = 0; i < 3; i++)
+        for (j = 0; j < 4; j++)
+            tmp.m[i][j] = r[i][0] * result->m[0][j] +
+                          r[i][1] * result->m[1][j] +
+                          r[i][2] * result->m[2][j];
+
+    memcpy(result->m, tmp.m, 3 * sizeof(tmp.m[0]));
+}
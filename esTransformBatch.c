@@ -0,0 +1,323 @@
+//
+// esTransformBatch.c
+//
+//    Batched versions of the esTransform.c matrix functions, plus the small
+//    thread pool that splits large batches. Each batch function is a range
+//    worker run by esBatchRun() over [0, count).
+//
+
+#include "esUtil.h"
+#include "esTransformSimd.h"
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#define PI 3.1415926535897932384626433832795f
+
+typedef void (*ESBatchFunc)(void *data, int begin, int end);
+
+///
+// Thread pool
+//
+// Workers sleep on start until generation changes, run their share of the
+// batch, and the last one to finish signals done. The caller runs the
+// first share itself.
+//
+
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t  start, done;
+    pthread_t       threads[ES_BATCH_MAX_THREADS];
+    int             numThreads;     // including the caller
+    int             quit;
+    uint64_t        generation;
+
+    ESBatchFunc     func;
+    void           *data;
+    int             count, active, pending;
+} esPool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .start = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+    .numThreads = 1,
+};
+
+static void *
+esBatchWorker(void *arg)
+{
+    int index = (int) (intptr_t) arg;
+    uint64_t seen = 0;
+
+    pthread_mutex_lock(&esPool.lock);
+    for (;;)
+    {
+        while (esPool.generation == seen && !esPool.quit)
+            pthread_cond_wait(&esPool.start, &esPool.lock);
+        if (esPool.quit)
+            break;
+        seen = esPool.generation;
+        if (index >= esPool.active)
+            continue;
+
+        ESBatchFunc func = esPool.func;
+        void *data = esPool.data;
+        int begin = (int) ((int64_t) esPool.count * index / esPool.active);
+        int end = (int) ((int64_t) esPool.count * (index + 1) / esPool.active);
+
+        pthread_mutex_unlock(&esPool.lock);
+        func(data, begin, end);
+        pthread_mutex_lock(&esPool.lock);
+
+        if (--esPool.pending == 0)
+            pthread_cond_signal(&esPool.done);
+    }
+    pthread_mutex_unlock(&esPool.lock);
+
+    return NULL;
+}
+
+static void
+esBatchStopThreads(void)
+{
+    int i;
+
+    pthread_mutex_lock(&esPool.lock);
+    esPool.quit = 1;
+    pthread_cond_broadcast(&esPool.start);
+    pthread_mutex_unlock(&esPool.lock);
+
+    for (i = 1; i < esPool.numThreads; i++)
+        pthread_join(esPool.threads[i], NULL);
+
+    // New workers start out having seen generation 0.
+    esPool.numThreads = 1;
+    esPool.quit = 0;
+    esPool.generation = 0;
+}
+
+int ESUTIL_API
+esBatchSetThreads(int threads)
+{
+    int i;
+
+    if (threads < 1)
+        threads = 1;
+    if (threads > ES_BATCH_MAX_THREADS)
+        threads = ES_BATCH_MAX_THREADS;
+
+    esBatchStopThreads();
+
+    for (i = 1; i < threads; i++)
+    {
+        if (pthread_create(&esPool.threads[i], NULL, esBatchWorker,
+                           (void *) (intptr_t) i) != 0)
+            break;
+        esPool.numThreads = i + 1;
+    }
+
+    return esPool.numThreads;
+}
+
+static void
+esBatchRun(ESBatchFunc func, void *data, int count)
+{
+    int active = count / ES_BATCH_MIN_PER_THREAD;
+
+    if (active > esPool.numThreads)
+        active = esPool.numThreads;
+    if (active <= 1)
+    {
+        func(data, 0, count);
+        return;
+    }
+
+    pthread_mutex_lock(&esPool.lock);
+    esPool.func = func;
+    esPool.data = data;
+    esPool.count = count;
+    esPool.active = active;
+    esPool.pending = active - 1;
+    esPool.generation++;
+    pthread_cond_broadcast(&esPool.start);
+    pthread_mutex_unlock(&esPool.lock);
+
+    func(data, 0, (int) ((int64_t) count / active));
+
+    pthread_mutex_lock(&esPool.lock);
+    while (esPool.pending > 0)
+        pthread_cond_wait(&esPool.done, &esPool.lock);
+    pthread_mutex_unlock(&esPool.lock);
+}
+
+///
+// esMatrixMultiplyBatch
+//
+
+typedef struct
+{
+    ESMatrix *result, *srcA, *srcB;
+} ESMultiplyBatch;
+
+static void
+esMultiplyRange(void *data, int begin, int end)
+{
+    ESMultiplyBatch *batch = data;
+
+    esKernelCurrent()->multiplyBatch(&batch->result[begin], &batch->srcA[begin],
+                                     &batch->srcB[begin], 1, end - begin);
+}
+
+void ESUTIL_API
+esMatrixMultiplyBatch(ESMatrix *result, ESMatrix *srcA, ESMatrix *srcB, int count)
+{
+    ESMultiplyBatch batch = { result, srcA, srcB };
+
+    esBatchRun(esMultiplyRange, &batch, count);
+}
+
+///
+// esComposeBatch
+//
+// The rotation is built exactly as esRotate builds rotMat. Applied to an
+// identity translated by t, esRotate and esScale only multiply by zeros
+// and ones apart from the final scale, so writing the rows directly gives
+// the same bits as the single-matrix calls.
+//
+
+typedef struct
+{
+    uint8_t *result;
+    int stride;
+    const ESTransformSoA *xf;
+} ESComposeBatch;
+
+static void
+esComposeRange(void *data, int begin, int end)
+{
+    ESComposeBatch *batch = data;
+    const ESTransformSoA *xf = batch->xf;
+    int i, j;
+
+    for (i = begin; i < end; i++)
+    {
+        ESMatrix *m = (ESMatrix *) (batch->result + (size_t) i * batch->stride);
+        float x = xf->ax[i], y = xf->ay[i], z = xf->az[i];
+        float mag = sqrtf(x * x + y * y + z * z);
+        float s = xf->scale[i];
+
+        esMatrixLoadIdentity(m);
+        m->m[3][0] = xf->tx[i];
+        m->m[3][1] = xf->ty[i];
+        m->m[3][2] = xf->tz[i];
+
+        if (mag > 0.0f)
+        {
+            float sinAngle = sinf(xf->angle[i] * PI / 180.0f);
+            float cosAngle = cosf(xf->angle[i] * PI / 180.0f);
+            float oneMinusCos = 1.0f - cosAngle;
+            float xs, ys, zs;
+
+            x /= mag;
+            y /= mag;
+            z /= mag;
+            xs = x * sinAngle;
+            ys = y * sinAngle;
+            zs = z * sinAngle;
+
+            m->m[0][0] = (oneMinusCos * (x * x)) + cosAngle;
+            m->m[0][1] = (oneMinusCos * (x * y)) - zs;
+            m->m[0][2] = (oneMinusCos * (z * x)) + ys;
+            m->m[1][0] = (oneMinusCos * (x * y)) + zs;
+            m->m[1][1] = (oneMinusCos * (y * y)) + cosAngle;
+            m->m[1][2] = (oneMinusCos * (y * z)) - xs;
+            m->m[2][0] = (oneMinusCos * (z * x)) - ys;
+            m->m[2][1] = (oneMinusCos * (y * z)) + xs;
+            m->m[2][2] = (oneMinusCos * (z * z)) + cosAngle;
+        }
+
+        // All of rows 0-2, zeros included, as esScale does: a negative
+        // scale turns them into -0.
+        for (j = 0; j < 12; j++)
+            m->m[j / 4][j % 4] *= s;
+    }
+}
+
+void ESUTIL_API
+esComposeBatch(ESMatrix *result, int resultStride, const ESTransformSoA *xf, int count)
+{
+    ESComposeBatch batch = {
+        (uint8_t *) result,
+        resultStride ? resultStride : (int) sizeof(ESMatrix),
+        xf,
+    };
+
+    esBatchRun(esComposeRange, &batch, count);
+}
+
+///
+// esMVPBatch
+//
+// Objects go through in chunks of ES_MVP_CHUNK, one batched multiply per
+// product, so view and viewProjection are loaded once per chunk rather
+// than once per object.
+//
+
+#define ES_MVP_CHUNK 64
+
+typedef struct
+{
+    ESMatrix *mvp;
+    float (*normal)[12];
+    const ESMatrix *model;
+    ESMatrix viewProjection, view;
+} ESMVPBatch;
+
+static void
+esCross(float *out, const float *a, const float *b)
+{
+    out[0] = a[1] * b[2] - a[2] * b[1];
+    out[1] = a[2] * b[0] - a[0] * b[2];
+    out[2] = a[0] * b[1] - a[1] * b[0];
+    out[3] = 0.0f;
+}
+
+static void
+esMVPRange(void *data, int begin, int end)
+{
+    ESMVPBatch *batch = data;
+    const ESKernelFuncs *kernel = esKernelCurrent();
+    ESMatrix mv[ES_MVP_CHUNK];
+    int i, j, n;
+
+    for (i = begin; i < end; i += n)
+    {
+        n = end - i < ES_MVP_CHUNK ? end - i : ES_MVP_CHUNK;
+
+        // model * view first, as mvp may be model.
+        if (batch->normal)
+            kernel->multiplyBatch(mv, &batch->model[i], &batch->view, 0, n);
+        kernel->multiplyBatch(&batch->mvp[i], &batch->model[i], &batch->viewProjection, 0, n);
+
+        if (batch->normal)
+        {
+            for (j = 0; j < n; j++)
+            {
+                esCross(&batch->normal[i + j][0], mv[j].m[1], mv[j].m[2]);
+                esCross(&batch->normal[i + j][4], mv[j].m[2], mv[j].m[0]);
+                esCross(&batch->normal[i + j][8], mv[j].m[0], mv[j].m[1]);
+            }
+        }
+    }
+}
+
+void ESUTIL_API
+esMVPBatch(ESMatrix *mvp, float (*normal)[12], const ESMatrix *model, ESMatrix *view, ESMatrix *projection, int count)
+{
+    ESMVPBatch batch = { mvp, normal, model };
+
+    batch.view = *view;
+    esMatrixMultiply(&batch.viewProjection, view, projection);
+    esBatchRun(esMVPRange, &batch, count);
+}
@@ -0,0 +1,303 @@
+//
+// esTransformSimd.c
+//
+//    SSE, AVX2 and NEON versions of esMatrixMultiply, esTranslate and
+//    esScale, and of the multiply loop behind the batch functions. ESMatrix
+//    rows are four contiguous floats, so a row is one vector and row i of
+//    srcA * srcB is the sum of srcB's rows weighted by the elements of
+//    srcA's row i. The sums are taken in the same order as the scalar code;
+//    see esUtil.h for how far each kernel may stray from it.
+//
+//    The result may alias either source, so every kernel loads all of its
+//    inputs before storing anything.
+//
+
+#include "esTransformSimd.h"
+
+#if defined(ES_HAVE_SSE) || defined(ES_HAVE_AVX2)
+#include <immintrin.h>
+#endif
+
+#if defined(ES_HAVE_NEON)
+#include <arm_neon.h>
+#endif
+
+#if defined(ES_HAVE_SSE)
+
+#define SPLAT(v, i) _mm_shuffle_ps(v, v, _MM_SHUFFLE(i, i, i, i))
+
+static inline __m128
+rowMultiplySSE(__m128 a, __m128 b0, __m128 b1, __m128 b2, __m128 b3)
+{
+    __m128 r = _mm_mul_ps(SPLAT(a, 0), b0);
+    r = _mm_add_ps(r, _mm_mul_ps(SPLAT(a, 1), b1));
+    r = _mm_add_ps(r, _mm_mul_ps(SPLAT(a, 2), b2));
+    return _mm_add_ps(r, _mm_mul_ps(SPLAT(a, 3), b3));
+}
+
+// srcA * b, with b's rows already loaded.
+static inline void
+rowsMultiplySSE(ESMatrix *result, const ESMatrix *srcA, __m128 b0, __m128 b1, __m128 b2, __m128 b3)
+{
+    __m128 a0 = _mm_loadu_ps(srcA->m[0]);
+    __m128 a1 = _mm_loadu_ps(srcA->m[1]);
+    __m128 a2 = _mm_loadu_ps(srcA->m[2]);
+    __m128 a3 = _mm_loadu_ps(srcA->m[3]);
+
+    __m128 r0 = rowMultiplySSE(a0, b0, b1, b2, b3);
+    __m128 r1 = rowMultiplySSE(a1, b0, b1, b2, b3);
+    __m128 r2 = rowMultiplySSE(a2, b0, b1, b2, b3);
+    __m128 r3 = rowMultiplySSE(a3, b0, b1, b2, b3);
+
+    _mm_storeu_ps(result->m[0], r0);
+    _mm_storeu_ps(result->m[1], r1);
+    _mm_storeu_ps(result->m[2], r2);
+    _mm_storeu_ps(result->m[3], r3);
+}
+
+static void
+esMatrixMultiplySSE(ESMatrix *result, ESMatrix *srcA, ESMatrix *srcB)
+{
+    rowsMultiplySSE(result, srcA, _mm_loadu_ps(srcB->m[0]), _mm_loadu_ps(srcB->m[1]),
+                    _mm_loadu_ps(srcB->m[2]), _mm_loadu_ps(srcB->m[3]));
+}
+
+static void
+esMatrixMultiplyBatchSSE(ESMatrix *result, const ESMatrix *srcA, const ESMatrix *srcB, int bStep, int count)
+{
+    int i;
+
+    if (bStep == 0)
+    {
+        __m128 b0 = _mm_loadu_ps(srcB->m[0]);
+        __m128 b1 = _mm_loadu_ps(srcB->m[1]);
+        __m128 b2 = _mm_loadu_ps(srcB->m[2]);
+        __m128 b3 = _mm_loadu_ps(srcB->m[3]);
+
+        for (i = 0; i < count; i++)
+            rowsMultiplySSE(&result[i], &srcA[i], b0, b1, b2, b3);
+        return;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        const ESMatrix *b = &srcB[i * bStep];
+
+        rowsMultiplySSE(&result[i], &srcA[i], _mm_loadu_ps(b->m[0]), _mm_loadu_ps(b->m[1]),
+                        _mm_loadu_ps(b->m[2]), _mm_loadu_ps(b->m[3]));
+    }
+}
+
+static void
+esTranslateSSE(ESMatrix *result, float tx, float ty, float tz)
+{
+    __m128 t = _mm_mul_ps(_mm_loadu_ps(result->m[0]), _mm_set1_ps(tx));
+    t = _mm_add_ps(t, _mm_mul_ps(_mm_loadu_ps(result->m[1]), _mm_set1_ps(ty)));
+    t = _mm_add_ps(t, _mm_mul_ps(_mm_loadu_ps(result->m[2]), _mm_set1_ps(tz)));
+    _mm_storeu_ps(result->m[3], _mm_add_ps(_mm_loadu_ps(result->m[3]), t));
+}
+
+static void
+esScaleSSE(ESMatrix *result, float sx, float sy, float sz)
+{
+    _mm_storeu_ps(result->m[0], _mm_mul_ps(_mm_loadu_ps(result->m[0]), _mm_set1_ps(sx)));
+    _mm_storeu_ps(result->m[1], _mm_mul_ps(_mm_loadu_ps(result->m[1]), _mm_set1_ps(sy)));
+    _mm_storeu_ps(result->m[2], _mm_mul_ps(_mm_loadu_ps(result->m[2]), _mm_set1_ps(sz)));
+}
+
+const ESKernelFuncs esKernelSSE = {
+    .multiply = esMatrixMultiplySSE,
+    .translate = esTranslateSSE,
+    .scale = esScaleSSE,
+    .multiplyBatch = esMatrixMultiplyBatchSSE,
+};
+
+#endif // ES_HAVE_SSE
+
+#if defined(ES_HAVE_AVX2)
+
+//
+// Two rows of the result per 256-bit vector: each lane holds one row of
+// srcA, and srcB's rows are broadcast to both lanes. Only called after
+// esKernelSupported() has checked the CPU for AVX2 and FMA.
+//
+__attribute__((target("avx2,fma")))
+static inline __m256
+rowPairMultiplyAVX2(__m256 a, __m256 b0, __m256 b1, __m256 b2, __m256 b3)
+{
+    __m256 r = _mm256_mul_ps(_mm256_permute_ps(a, 0x00), b0);
+    r = _mm256_fmadd_ps(_mm256_permute_ps(a, 0x55), b1, r);
+    r = _mm256_fmadd_ps(_mm256_permute_ps(a, 0xaa), b2, r);
+    return _mm256_fmadd_ps(_mm256_permute_ps(a, 0xff), b3, r);
+}
+
+__attribute__((target("avx2,fma")))
+static void
+esMatrixMultiplyAVX2(ESMatrix *result, ESMatrix *srcA, ESMatrix *srcB)
+{
+    __m256 b0 = _mm256_broadcast_ps((const __m128 *) srcB->m[0]);
+    __m256 b1 = _mm256_broadcast_ps((const __m128 *) srcB->m[1]);
+    __m256 b2 = _mm256_broadcast_ps((const __m128 *) srcB->m[2]);
+    __m256 b3 = _mm256_broadcast_ps((const __m128 *) srcB->m[3]);
+    __m256 a01 = _mm256_loadu_ps(srcA->m[0]);
+    __m256 a23 = _mm256_loadu_ps(srcA->m[2]);
+
+    __m256 r01 = rowPairMultiplyAVX2(a01, b0, b1, b2, b3);
+    __m256 r23 = rowPairMultiplyAVX2(a23, b0, b1, b2, b3);
+
+    _mm256_storeu_ps(result->m[0], r01);
+    _mm256_storeu_ps(result->m[2], r23);
+}
+
+//
+// With a shared srcB, two objects per iteration: srcB stays in four
+// registers and the eight row pairs give the FMA units independent work.
+// Both objects are loaded before either is stored.
+//
+__attribute__((target("avx2,fma")))
+static void
+esMatrixMultiplyBatchAVX2(ESMatrix *result, const ESMatrix *srcA, const ESMatrix *srcB, int bStep, int count)
+{
+    int i = 0;
+
+    if (bStep == 0)
+    {
+        __m256 b0 = _mm256_broadcast_ps((const __m128 *) srcB->m[0]);
+        __m256 b1 = _mm256_broadcast_ps((const __m128 *) srcB->m[1]);
+        __m256 b2 = _mm256_broadcast_ps((const __m128 *) srcB->m[2]);
+        __m256 b3 = _mm256_broadcast_ps((const __m128 *) srcB->m[3]);
+
+        for (; i + 2 <= count; i += 2)
+        {
+            __m256 a01 = _mm256_loadu_ps(srcA[i].m[0]);
+            __m256 a23 = _mm256_loadu_ps(srcA[i].m[2]);
+            __m256 c01 = _mm256_loadu_ps(srcA[i + 1].m[0]);
+            __m256 c23 = _mm256_loadu_ps(srcA[i + 1].m[2]);
+
+            a01 = rowPairMultiplyAVX2(a01, b0, b1, b2, b3);
+            a23 = rowPairMultiplyAVX2(a23, b0, b1, b2, b3);
+            c01 = rowPairMultiplyAVX2(c01, b0, b1, b2, b3);
+            c23 = rowPairMultiplyAVX2(c23, b0, b1, b2, b3);
+
+            _mm256_storeu_ps(result[i].m[0], a01);
+            _mm256_storeu_ps(result[i].m[2], a23);
+            _mm256_storeu_ps(result[i + 1].m[0], c01);
+            _mm256_storeu_ps(result[i + 1].m[2], c23);
+        }
+        if (i < count)
+        {
+            __m256 a01 = _mm256_loadu_ps(srcA[i].m[0]);
+            __m256 a23 = _mm256_loadu_ps(srcA[i].m[2]);
+
+            _mm256_storeu_ps(result[i].m[0], rowPairMultiplyAVX2(a01, b0, b1, b2, b3));
+            _mm256_storeu_ps(result[i].m[2], rowPairMultiplyAVX2(a23, b0, b1, b2, b3));
+        }
+        return;
+    }
+
+    for (; i < count; i++)
+        esMatrixMultiplyAVX2(&result[i], (ESMatrix *) &srcA[i], (ESMatrix *) &srcB[i * bStep]);
+}
+
+// esTranslate and esScale touch too little data to gain from wider
+// vectors, and fusing them would give up bit-exactness for nothing.
+const ESKernelFuncs esKernelAVX2 = {
+    .multiply = esMatrixMultiplyAVX2,
+    .translate = esTranslateSSE,
+    .scale = esScaleSSE,
+    .multiplyBatch = esMatrixMultiplyBatchAVX2,
+};
+
+#endif // ES_HAVE_AVX2
+
+#if defined(ES_HAVE_NEON)
+
+// vmulq + vaddq rather than vfmaq, so the results stay bit-identical to
+// the scalar code.
+static inline float32x4_t
+rowMultiplyNEON(float32x4_t a, float32x4_t b0, float32x4_t b1, float32x4_t b2, float32x4_t b3)
+{
+    float32x4_t r = vmulq_laneq_f32(b0, a, 0);
+    r = vaddq_f32(r, vmulq_laneq_f32(b1, a, 1));
+    r = vaddq_f32(r, vmulq_laneq_f32(b2, a, 2));
+    return vaddq_f32(r, vmulq_laneq_f32(b3, a, 3));
+}
+
+// srcA * b, with b's rows already loaded.
+static inline void
+rowsMultiplyNEON(ESMatrix *result, const ESMatrix *srcA, float32x4_t b0, float32x4_t b1, float32x4_t b2, float32x4_t b3)
+{
+    float32x4_t a0 = vld1q_f32(srcA->m[0]);
+    float32x4_t a1 = vld1q_f32(srcA->m[1]);
+    float32x4_t a2 = vld1q_f32(srcA->m[2]);
+    float32x4_t a3 = vld1q_f32(srcA->m[3]);
+
+    float32x4_t r0 = rowMultiplyNEON(a0, b0, b1, b2, b3);
+    float32x4_t r1 = rowMultiplyNEON(a1, b0, b1, b2, b3);
+    float32x4_t r2 = rowMultiplyNEON(a2, b0, b1, b2, b3);
+    float32x4_t r3 = rowMultiplyNEON(a3, b0, b1, b2, b3);
+
+    vst1q_f32(result->m[0], r0);
+    vst1q_f32(result->m[1], r1);
+    vst1q_f32(result->m[2], r2);
+    vst1q_f32(result->m[3], r3);
+}
+
+static void
+esMatrixMultiplyNEON(ESMatrix *result, ESMatrix *srcA, ESMatrix *srcB)
+{
+    rowsMultiplyNEON(result, srcA, vld1q_f32(srcB->m[0]), vld1q_f32(srcB->m[1]),
+                     vld1q_f32(srcB->m[2]), vld1q_f32(srcB->m[3]));
+}
+
+static void
+esMatrixMultiplyBatchNEON(ESMatrix *result, const ESMatrix *srcA, const ESMatrix *srcB, int bStep, int count)
+{
+    int i;
+
+    if (bStep == 0)
+    {
+        float32x4_t b0 = vld1q_f32(srcB->m[0]);
+        float32x4_t b1 = vld1q_f32(srcB->m[1]);
+        float32x4_t b2 = vld1q_f32(srcB->m[2]);
+        float32x4_t b3 = vld1q_f32(srcB->m[3]);
+
+        for (i = 0; i < count; i++)
+            rowsMultiplyNEON(&result[i], &srcA[i], b0, b1, b2, b3);
+        return;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        const ESMatrix *b = &srcB[i * bStep];
+
+        rowsMultiplyNEON(&result[i], &srcA[i], vld1q_f32(b->m[0]), vld1q_f32(b->m[1]),
+                         vld1q_f32(b->m[2]), vld1q_f32(b->m[3]));
+    }
+}
+
+static void
+esTranslateNEON(ESMatrix *result, float tx, float ty, float tz)
+{
+    float32x4_t t = vmulq_n_f32(vld1q_f32(result->m[0]), tx);
+    t = vaddq_f32(t, vmulq_n_f32(vld1q_f32(result->m[1]), ty));
+    t = vaddq_f32(t, vmulq_n_f32(vld1q_f32(result->m[2]), tz));
+    vst1q_f32(result->m[3], vaddq_f32(vld1q_f32(result->m[3]), t));
+}
+
+static void
+esScaleNEON(ESMatrix *result, float sx, float sy, float sz)
+{
+    vst1q_f32(result->m[0], vmulq_n_f32(vld1q_f32(result->m[0]), sx));
+    vst1q_f32(result->m[1], vmulq_n_f32(vld1q_f32(result->m[1]), sy));
+    vst1q_f32(result->m[2], vmulq_n_f32(vld1q_f32(result->m[2]), sz));
+}
+
+const ESKernelFuncs esKernelNEON = {
+    .multiply = esMatrixMultiplyNEON,
+    .translate = esTranslateNEON,
+    .scale = esScaleNEON,
+    .multiplyBatch = esMatrixMultiplyBatchNEON,
+};
+
+#endif // ES_HAVE_NEON
@@ -0,0 +1,46 @@
+//
+// esTransformSimd.h
+//
+//    SIMD kernels behind esMatrixMultiply, esTranslate, esScale and the
+//    batch functions. Only esTransform.c and esTransformBatch.c include
+//    this; everyone else goes through esUtil.h.
+//
+
+#ifndef ESTRANSFORMSIMD_H
+#define ESTRANSFORMSIMD_H
+
+#include "esUtil.h"
+
+typedef struct
+{
+    void (*multiply)(ESMatrix *result, ESMatrix *srcA, ESMatrix *srcB);
+    void (*translate)(ESMatrix *result, float tx, float ty, float tz);
+    void (*scale)(ESMatrix *result, float sx, float sy, float sz);
+
+    // result[i] = srcA[i] * srcB[i * bStep] for i in [0, count), so bStep 0
+    // multiplies every srcA by the one srcB. Gives the same bits as
+    // multiply. result[i] may be srcA[i] or srcB[i * bStep]; with bStep 0,
+    // srcB is read before anything is stored.
+    void (*multiplyBatch)(ESMatrix *result, const ESMatrix *srcA,
+                          const ESMatrix *srcB, int bStep, int count);
+} ESKernelFuncs;
+
+// The kernel esSetKernel() last selected, for the batch functions.
+const ESKernelFuncs *esKernelCurrent(void);
+
+#if defined(__SSE__)
+#define ES_HAVE_SSE 1
+extern const ESKernelFuncs esKernelSSE;
+#endif
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define ES_HAVE_AVX2 1
+extern const ESKernelFuncs esKernelAVX2;
+#endif
+
+#if defined(__aarch64__)
+#define ES_HAVE_NEON 1
+extern const ESKernelFuncs esKernelNEON;
+#endif
+
+#endif // ESTRANSFORMSIMD_H
@@ -147,6 +147,157 @@ void ESUTIL_API esMatrixMultiply(ESMatrix *result, ESMatrix *srcA, ESMatrix *src
 //
 void ESUTIL_API esMatrixLoadIdentity(ESMatrix *result);
 
+///
+// Quaternions
+//
+// A rotation as a unit quaternion, so that several rotations compose with
+// a 16-multiply quaternion product and become a matrix once. Angles are in
+// degrees and turn the same way as esRotate.
+//
+
+typedef struct
+{
+    float   x, y, z, w;
+} ESQuaternion;
+
+//
+/// \brief the rotation esRotate would apply for the same angle and axis; a zero axis gives the identity
+//
+void ESUTIL_API esQuaternionFromAxisAngle(ESQuaternion *result, float angle, float x, float y, float z);
+
+//
+/// \brief the rotation of esRotate about the x axis, then the y axis, then the z axis, by the given angles
+//
+void ESUTIL_API esQuaternionFromEuler(ESQuaternion *result, float x, float y, float z);
+
+//
+/// \brief result = a * b: the rotation b followed by a, so esQuaternionToMatrix(result) is esMatrixMultiply of the matrices of a and b
+//
+void ESUTIL_API esQuaternionMultiply(ESQuaternion *result, const ESQuaternion *a, const ESQuaternion *b);
+
+//
+/// \brief scale q to unit length, to undo drift after many multiplies
+//
+void ESUTIL_API esQuaternionNormalize(ESQuaternion *q);
+
+//
+/// \brief spherical linear interpolation from a (t = 0) to b (t = 1) along the shorter arc
+//
+void ESUTIL_API esQuaternionSlerp(ESQuaternion *result, const ESQuaternion *a, const ESQuaternion *b, float t);
+
+//
+/// \brief load the rotation matrix of q into result, as esMatrixLoadIdentity and esRotate would
+//
+void ESUTIL_API esQuaternionToMatrix(ESMatrix *result, const ESQuaternion *q);
+
+//
+/// \brief multiply result by the rotation matrix of q, like esRotate; only the upper 3x3 is multiplied
+//
+void ESUTIL_API esRotateQuaternion(ESMatrix *result, const ESQuaternion *q);
+
+///
+// SIMD kernels
+//
+// esMatrixMultiply, esTranslate and esScale (and through esMatrixMultiply,
+// esRotate, esFrustum, esPerspective and esOrtho) run on the best kernel the
+// CPU supports, picked once at load time. Setting ES_KERNEL to scalar, sse,
+// avx2 or neon in the environment overrides the choice.
+//
+// Tolerance against the scalar reference:
+//   sse, neon  0 ULP. Same operations in the same order, so bit-identical.
+//   avx2       Uses fused multiply-add in esMatrixMultiply. Each element is
+//              within 6 ULP of sum(|srcA[i][k] * srcB[k][j]|), the usual
+//              yardstick for a dot product that may cancel: the scalar and
+//              fused sums round 7 and 4 times, each by at most half an ULP
+//              of that sum. esTranslate and esScale are bit-identical.
+//
+
+typedef enum
+{
+    ES_KERNEL_SCALAR,
+    ES_KERNEL_SSE,
+    ES_KERNEL_AVX2,
+    ES_KERNEL_NEON,
+    ES_KERNEL_COUNT
+} ESKernel;
+
+//
+/// \brief return TRUE if kernel was built in and the CPU can run it
+//
+int ESUTIL_API esKernelSupported(ESKernel kernel);
+
+//
+/// \brief select the kernel used by the matrix functions; returns FALSE and keeps the current one if it is not supported
+//
+int ESUTIL_API esSetKernel(ESKernel kernel);
+
+//
+/// \brief return the kernel in use
+//
+ESKernel ESUTIL_API esGetKernel(void);
+
+//
+/// \brief return the name of kernel, as accepted by ES_KERNEL
+//
+const char * ESUTIL_API esKernelName(ESKernel kernel);
+
+//
+/// \brief scalar reference implementations of esScale, esTranslate and esMatrixMultiply
+//
+void ESUTIL_API esScaleScalar(ESMatrix *result, float sx, float sy, float sz);
+void ESUTIL_API esTranslateScalar(ESMatrix *result, float tx, float ty, float tz);
+void ESUTIL_API esMatrixMultiplyScalar(ESMatrix *result, ESMatrix *srcA, ESMatrix *srcB);
+
+///
+// Batch functions
+//
+// Work on count objects per call so the per-call overhead is paid once.
+// The multiplies run as one loop per kernel with no indirect call per
+// object; each matrix is vectorized on its own, a right-hand matrix shared
+// by the batch stays in registers, and AVX2 does two objects at a time.
+// Vectorizing across objects would need SoA matrices: transposing from
+// ESMatrix arrays cost more than it saved. Batches of at least
+// ES_BATCH_MIN_PER_THREAD objects per thread are split across the threads
+// set with esBatchSetThreads. The batch functions must not be called from
+// more than one thread at a time.
+//
+
+#define ES_BATCH_MAX_THREADS 64
+#define ES_BATCH_MIN_PER_THREAD 1024
+
+//
+/// \brief per-object transform parameters, one array per component (SoA)
+//
+typedef struct
+{
+    const float *tx, *ty, *tz;      // translation
+    const float *ax, *ay, *az;      // rotation axis, need not be normalized
+    const float *angle;             // rotation angle in degrees
+    const float *scale;             // uniform scale
+} ESTransformSoA;
+
+//
+/// \brief use up to threads threads (the caller included) for large batches; returns the number in use
+//
+int ESUTIL_API esBatchSetThreads(int threads);
+
+//
+/// \brief result[i] = srcA[i] * srcB[i] for count matrix pairs; result may alias either source
+//
+void ESUTIL_API esMatrixMultiplyBatch(ESMatrix *result, ESMatrix *srcA, ESMatrix *srcB, int count);
+
+//
+/// \brief build count model matrices, each equal to esMatrixLoadIdentity, esTranslate, esRotate and esScale in that order
+/// \param result First matrix; consecutive matrices are resultStride bytes apart, so they can sit inside an array of structs (0 means sizeof(ESMatrix))
+//
+void ESUTIL_API esComposeBatch(ESMatrix *result, int resultStride, const ESTransformSoA *xf, int count);
+
+//
+/// \brief for count model matrices, mvp[i] = model[i] * view * projection as esMatrixMultiply composes them; view * projection is formed once, so results can differ from two esMatrixMultiply calls by rounding
+/// \param normal If not NULL, receives the cofactors of the upper 3x3 of model[i] * view as three vec4 columns (std140 mat3); that is the inverse transpose up to scale, so normalize transformed normals
+//
+void ESUTIL_API esMVPBatch(ESMatrix *mvp, float (*normal)[12], const ESMatrix *model, ESMatrix *view, ESMatrix *projection, int count);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,739 @@
+/* Microbenchmarks for every esTransform.c entry point, on every SIMD kernel
+ * the CPU supports, and for the batched functions at several thread counts.
+ * Needs neither Vulkan nor X; 'make bench' builds and runs it.
+ *
+ * Each case is warmed up, sized so that one repetition takes about
+ * --rep-ms, and timed over --reps repetitions with CLOCK_MONOTONIC. The
+ * report is JSON on stdout (or --output) with the ns/op distribution over
+ * the repetitions, so runs of different compilers and flags can be diffed.
+ *
+ * The kernels are also checked against the scalar reference first; the
+ * exit status is non-zero if any of them is out of tolerance.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "esUtil.h"
+
+#ifndef ESBENCH_FLAGS
+#define ESBENCH_FLAGS ""
+#endif
+
+#define NUM_MATRICES 1024
+#define MAX_REPS 1000
+
+/* Large enough that the pool splits the batch over all its threads. */
+#define BATCH (ES_BATCH_MAX_THREADS * ES_BATCH_MIN_PER_THREAD)
+
+static ESMatrix a[NUM_MATRICES], b[NUM_MATRICES], out[NUM_MATRICES];
+static ESQuaternion qa[NUM_MATRICES], qb[NUM_MATRICES], qout[NUM_MATRICES];
+static float angles[3][NUM_MATRICES];
+
+static ESMatrix *batch_a, *batch_out;
+static float (*batch_normal)[12];
+static float batch_params[8][BATCH];
+static ESTransformSoA batch_xf;
+
+static int pin_cpu = -1;
+static cpu_set_t all_cpus;
+
+static uint64_t
+now_ns(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static float
+random_float(void)
+{
+   return (float) rand() / RAND_MAX * 4.0f - 2.0f;
+}
+
+static void
+random_matrix(ESMatrix *m)
+{
+   for (int i = 0; i < 4; i++)
+      for (int j = 0; j < 4; j++)
+         m->m[i][j] = random_float();
+}
+
+static void
+fail(const char *msg)
+{
+   fprintf(stderr, "esbench: %s\n", msg);
+   exit(2);
+}
+
+/* Largest error of esMatrixMultiply against the scalar reference, in ULP
+ * of sum(|a[i][k] * b[k][j]|), the bound documented in esUtil.h. */
+static double
+check_multiply(void)
+{
+   double worst = 0.0;
+
+   for (int n = 0; n < NUM_MATRICES; n++) {
+      ESMatrix ref, got;
+
+      esMatrixMultiplyScalar(&ref, &a[n], &b[n]);
+      esMatrixMultiply(&got, &a[n], &b[n]);
+
+      for (int i = 0; i < 4; i++) {
+         for (int j = 0; j < 4; j++) {
+            float mag = 0.0f;
+            for (int k = 0; k < 4; k++)
+               mag += fabsf(a[n].m[i][k] * b[n].m[k][j]);
+
+            float ulp = nextafterf(mag, INFINITY) - mag;
+            double err = fabs((double) got.m[i][j] - ref.m[i][j]) / ulp;
+            if (err > worst)
+               worst = err;
+         }
+      }
+   }
+
+   return worst;
+}
+
+/* esTranslate and esScale must be bit-identical on every kernel. */
+static bool
+check_exact(void)
+{
+   for (int n = 0; n < NUM_MATRICES; n++) {
+      ESMatrix ref = a[n], got = a[n];
+
+      esTranslateScalar(&ref, b[n].m[0][0], b[n].m[0][1], b[n].m[0][2]);
+      esScaleScalar(&ref, b[n].m[1][0], b[n].m[1][1], b[n].m[1][2]);
+      esTranslate(&got, b[n].m[0][0], b[n].m[0][1], b[n].m[0][2]);
+      esScale(&got, b[n].m[1][0], b[n].m[1][1], b[n].m[1][2]);
+
+      if (memcmp(&ref, &got, sizeof(ref)) != 0)
+         return false;
+   }
+
+   return true;
+}
+
+/* esComposeBatch must match the single-matrix calls bit for bit. */
+static bool
+check_compose(void)
+{
+   esComposeBatch(out, 0, &batch_xf, NUM_MATRICES);
+
+   for (int n = 0; n < NUM_MATRICES; n++) {
+      ESMatrix ref;
+
+      esMatrixLoadIdentity(&ref);
+      esTranslate(&ref, batch_xf.tx[n], batch_xf.ty[n], batch_xf.tz[n]);
+      esRotate(&ref, batch_xf.angle[n], batch_xf.ax[n], batch_xf.ay[n],
+               batch_xf.az[n]);
+      esScale(&ref, batch_xf.scale[n], batch_xf.scale[n], batch_xf.scale[n]);
+
+      if (memcmp(&ref, &out[n], sizeof(ref)) != 0)
+         return false;
+   }
+
+   return true;
+}
+
+/* esMatrixMultiplyBatch and the mvp of esMVPBatch go through the kernel's
+ * batched multiply and must give the same bits as esMatrixMultiply, in
+ * place too. An odd count covers the tail of the two-at-a-time loops. */
+static bool
+check_multiply_batch(void)
+{
+   static ESMatrix in_place[NUM_MATRICES];
+   const int count = NUM_MATRICES - 1;
+   ESMatrix vp;
+
+   memcpy(in_place, a, sizeof(in_place));
+   esMatrixMultiplyBatch(out, a, b, count);
+   esMatrixMultiplyBatch(in_place, in_place, b, count);
+
+   for (int n = 0; n < count; n++) {
+      ESMatrix ref;
+
+      esMatrixMultiply(&ref, &a[n], &b[n]);
+      if (memcmp(&ref, &out[n], sizeof(ref)) != 0 ||
+          memcmp(&ref, &in_place[n], sizeof(ref)) != 0)
+         return false;
+   }
+
+   esMatrixMultiply(&vp, &b[0], &b[1]);
+   esMVPBatch(out, NULL, a, &b[0], &b[1], count);
+
+   for (int n = 0; n < count; n++) {
+      ESMatrix ref;
+
+      esMatrixMultiply(&ref, &a[n], &vp);
+      if (memcmp(&ref, &out[n], sizeof(ref)) != 0)
+         return false;
+   }
+
+   return true;
+}
+
+/* The quaternion path render_cube() takes must agree with three esRotate
+ * calls to within float rounding of the trigonometry. b[] entries are at
+ * most 2 in magnitude. */
+static double
+check_quaternion(void)
+{
+   double worst = 0.0;
+
+   for (int n = 0; n < NUM_MATRICES; n++) {
+      ESMatrix ref = b[n], got = b[n];
+      ESQuaternion q;
+
+      esRotate(&ref, angles[0][n], 1.0f, 0.0f, 0.0f);
+      esRotate(&ref, angles[1][n], 0.0f, 1.0f, 0.0f);
+      esRotate(&ref, angles[2][n], 0.0f, 0.0f, 1.0f);
+      esQuaternionFromEuler(&q, angles[0][n], angles[1][n], angles[2][n]);
+      esRotateQuaternion(&got, &q);
+
+      for (int i = 0; i < 4; i++) {
+         for (int j = 0; j < 4; j++) {
+            double err = fabs((double) got.m[i][j] - ref.m[i][j]);
+            if (err > worst)
+               worst = err;
+         }
+      }
+   }
+
+   return worst;
+}
+
+/* Each run function does one op per matrix (or quaternion) in the arrays.
+ * The in-place ones start every op from a[] so that repeated runs do not
+ * drift towards infinities or denormals. */
+
+static void
+run_multiply(void)
+{
+   for (int n = 0; n < NUM_MATRICES; n++)
+      esMatrixMultiply(&out[n], &a[n], &b[n]);
+}
+
+static void
+run_translate(void)
+{
+   for (int n = 0; n < NUM_MATRICES; n++) {
+      out[n] = a[n];
+      esTranslate(&out[n], 0.5f, -0.25f, 0.125f);
+   }
+}
+
+static void
+run_scale(void)
+{
+   for (int n = 0; n < NUM_MATRICES; n++) {
+      out[n] = a[n];
+      esScale(&out[n], 0.5f, 2.0f, 1.5f);
+   }
+}
+
+static void
+run_rotate(void)
+{
+   for (int n = 0; n < NUM_MATRICES; n++) {
+      out[n] = a[n];
+      esRotate(&out[n], angles[0][n], 1.0f, 2.0f, 3.0f);
+   }
+}
+
+static void
+run_frustum(void)
+{
+   for (int n = 0; n < NUM_MATRICES; n++) {
+      out[n] = a[n];
+      esFrustum(&out[n], -2.8f, 2.8f, -2.8f, 2.8f, 6.0f, 10.0f);
+   }
+}
+
+static void
+run_perspective(void)
+{
+   for (int n = 0; n < NUM_MATRICES; n++) {
+      out[n] = a[n];
+      esPerspective(&out[n], 60.0f, 16.0f / 9.0f, 1.0f, 20.0f);
+   }
+}
+
+static void
+run_ortho(void)
+{
+   for (int n = 0; n < NUM_MATRICES; n++) {
+      out[n] = a[n];
+      esOrtho(&out[n], -2.0f, 2.0f, -1.0f, 1.0f, -1.0f, 1.0f);
+   }
+}
+
+static void
+run_load_identity(void)
+{
+   for (int n = 0; n < NUM_MATRICES; n++)
+      esMatrixLoadIdentity(&out[n]);
+}
+
+/* The modelview of render_cube(), the old way and the quaternion way. */
+static void
+run_rotate_xyz(void)
+{
+   for (int n = 0; n < NUM_MATRICES; n++) {
+      esMatrixLoadIdentity(&out[n]);
+      esTranslate(&out[n], 0.0f, 0.0f, -8.0f);
+      esRotate(&out[n], angles[0][n], 1.0f, 0.0f, 0.0f);
+      esRotate(&out[n], angles[1][n], 0.0f, 1.0f, 0.0f);
+      esRotate(&out[n], angles[2][n], 0.0f, 0.0f, 1.0f);
+   }
+}
+
+static void
+run_quaternion_xyz(void)
+{
+   for (int n = 0; n < NUM_MATRICES; n++) {
+      ESQuaternion q;
+
+      esQuaternionFromEuler(&q, angles[0][n], angles[1][n], angles[2][n]);
+      esMatrixLoadIdentity(&out[n]);
+      esTranslate(&out[n], 0.0f, 0.0f, -8.0f);
+      esRotateQuaternion(&out[n], &q);
+   }
+}
+
+static void
+run_quat_axis_angle(void)
+{
+   for (int n = 0; n < NUM_MATRICES; n++)
+      esQuaternionFromAxisAngle(&qout[n], angles[0][n], 1.0f, 2.0f, 3.0f);
+}
+
+static void
+run_quat_euler(void)
+{
+   for (int n = 0; n < NUM_MATRICES; n++)
+      esQuaternionFromEuler(&qout[n], angles[0][n], angles[1][n], angles[2][n]);
+}
+
+static void
+run_quat_multiply(void)
+{
+   for (int n = 0; n < NUM_MATRICES; n++)
+      esQuaternionMultiply(&qout[n], &qa[n], &qb[n]);
+}
+
+static void
+run_quat_normalize(void)
+{
+   for (int n = 0; n < NUM_MATRICES; n++) {
+      qout[n] = qa[n];
+      esQuaternionNormalize(&qout[n]);
+   }
+}
+
+static void
+run_quat_slerp(void)
+{
+   for (int n = 0; n < NUM_MATRICES; n++)
+      esQuaternionSlerp(&qout[n], &qa[n], &qb[n], 0.3f);
+}
+
+static void
+run_quat_to_matrix(void)
+{
+   for (int n = 0; n < NUM_MATRICES; n++)
+      esQuaternionToMatrix(&out[n], &qa[n]);
+}
+
+static void
+run_rotate_quaternion(void)
+{
+   for (int n = 0; n < NUM_MATRICES; n++) {
+      out[n] = a[n];
+      esRotateQuaternion(&out[n], &qa[n]);
+   }
+}
+
+static void
+run_multiply_batch(void)
+{
+   esMatrixMultiplyBatch(batch_out, batch_a, batch_a, BATCH);
+}
+
+static void
+run_compose_batch(void)
+{
+   esComposeBatch(batch_out, 0, &batch_xf, BATCH);
+}
+
+static void
+run_mvp_batch(void)
+{
+   esMVPBatch(batch_out, batch_normal, batch_a, &a[0], &a[1], BATCH);
+}
+
+struct bench_case {
+   const char *name;
+   void (*run)(void);
+   /* Ops per run() call. */
+   int ops;
+   /* Goes through the SIMD kernel table, so it is run on every kernel. */
+   bool per_kernel;
+   /* A batch function, so it is run at every thread count. */
+   bool batched;
+};
+
+static const struct bench_case cases[] = {
+   { "esMatrixMultiply",          run_multiply,          NUM_MATRICES, true,  false },
+   { "esTranslate",               run_translate,         NUM_MATRICES, true,  false },
+   { "esScale",                   run_scale,             NUM_MATRICES, true,  false },
+   { "esRotate",                  run_rotate,            NUM_MATRICES, true,  false },
+   { "esFrustum",                 run_frustum,           NUM_MATRICES, true,  false },
+   { "esPerspective",             run_perspective,       NUM_MATRICES, true,  false },
+   { "esOrtho",                   run_ortho,             NUM_MATRICES, true,  false },
+   { "esMatrixLoadIdentity",      run_load_identity,     NUM_MATRICES, false, false },
+   { "render_cube esRotate x3",   run_rotate_xyz,        NUM_MATRICES, true,  false },
+   { "render_cube quaternion",    run_quaternion_xyz,    NUM_MATRICES, true,  false },
+   { "esQuaternionFromAxisAngle", run_quat_axis_angle,   NUM_MATRICES, false, false },
+   { "esQuaternionFromEuler",     run_quat_euler,        NUM_MATRICES, false, false },
+   { "esQuaternionMultiply",      run_quat_multiply,     NUM_MATRICES, false, false },
+   { "esQuaternionNormalize",     run_quat_normalize,    NUM_MATRICES, false, false },
+   { "esQuaternionSlerp",         run_quat_slerp,        NUM_MATRICES, false, false },
+   { "esQuaternionToMatrix",      run_quat_to_matrix,    NUM_MATRICES, false, false },
+   { "esRotateQuaternion",        run_rotate_quaternion, NUM_MATRICES, false, false },
+   { "esMatrixMultiplyBatch",     run_multiply_batch,    BATCH,        true,  true },
+   { "esComposeBatch",            run_compose_batch,     BATCH,        false, true },
+   { "esMVPBatch",                run_mvp_batch,         BATCH,        true,  true },
+};
+
+struct result {
+   double min, p50, p90, p99, max, mean;
+};
+
+static int
+compare_double(const void *a, const void *b)
+{
+   double x = *(const double *) a, y = *(const double *) b;
+
+   return x < y ? -1 : x > y;
+}
+
+/* Nearest-rank percentile of a sorted array. */
+static double
+percentile(const double *sorted, int n, double p)
+{
+   int rank = (int) ceil(p / 100.0 * n);
+
+   if (rank < 1)
+      rank = 1;
+   if (rank > n)
+      rank = n;
+
+   return sorted[rank - 1];
+}
+
+/* Warm up for warmup_ms, which also sizes a repetition to about rep_ms,
+ * then time reps repetitions. */
+static struct result
+measure(const struct bench_case *c, int reps, double warmup_ms, double rep_ms)
+{
+   double ns[MAX_REPS], total = 0.0;
+   uint64_t calls = 0, start = now_ns(), elapsed;
+
+   do {
+      c->run();
+      calls++;
+      elapsed = now_ns() - start;
+   } while (elapsed < warmup_ms * 1e6);
+
+   uint64_t per_rep = (uint64_t) (rep_ms * 1e6 / ((double) elapsed / calls));
+   if (per_rep < 1)
+      per_rep = 1;
+
+   for (int r = 0; r < reps; r++) {
+      uint64_t t0 = now_ns();
+      for (uint64_t i = 0; i < per_rep; i++)
+         c->run();
+      ns[r] = (double) (now_ns() - t0) / ((double) per_rep * c->ops);
+      total += ns[r];
+   }
+
+   qsort(ns, reps, sizeof(ns[0]), compare_double);
+
+   return (struct result) {
+      .min = ns[0],
+      .p50 = percentile(ns, reps, 50),
+      .p90 = percentile(ns, reps, 90),
+      .p99 = percentile(ns, reps, 99),
+      .max = ns[reps - 1],
+      .mean = total / reps,
+   };
+}
+
+/* Workers inherit the affinity of the thread that creates them, so give
+ * them every CPU and keep only the calling thread pinned. */
+static int
+set_threads(int threads)
+{
+   if (pin_cpu >= 0)
+      sched_setaffinity(0, sizeof(all_cpus), &all_cpus);
+
+   threads = esBatchSetThreads(threads);
+
+   if (pin_cpu >= 0) {
+      cpu_set_t set;
+
+      CPU_ZERO(&set);
+      CPU_SET(pin_cpu, &set);
+      sched_setaffinity(0, sizeof(set), &set);
+   }
+
+   return threads;
+}
+
+static void
+init_data(void)
+{
+   srand(1);
+
+   for (int n = 0; n < NUM_MATRICES; n++) {
+      random_matrix(&a[n]);
+      random_matrix(&b[n]);
+      esMatrixLoadIdentity(&out[n]);
+      for (int i = 0; i < 3; i++)
+         angles[i][n] = random_float() * 180.0f;
+
+      esQuaternionFromAxisAngle(&qa[n], angles[0][n], random_float(),
+                                random_float(), random_float());
+      esQuaternionFromAxisAngle(&qb[n], angles[1][n], random_float(),
+                                random_float(), random_float());
+   }
+
+   batch_a = malloc(BATCH * sizeof(ESMatrix));
+   batch_out = malloc(BATCH * sizeof(ESMatrix));
+   batch_normal = malloc(BATCH * sizeof(*batch_normal));
+   if (!batch_a || !batch_out || !batch_normal)
+      fail("out of memory");
+
+   for (int n = 0; n < BATCH; n++)
+      batch_a[n] = a[n % NUM_MATRICES];
+
+   for (int i = 0; i < 8; i++)
+      for (int n = 0; n < BATCH; n++)
+         batch_params[i][n] = i == 6 ? random_float() * 180.0f : random_float();
+   /* A zero axis, which esRotate leaves unrotated. */
+   batch_params[3][0] = batch_params[4][0] = batch_params[5][0] = 0.0f;
+
+   batch_xf = (ESTransformSoA) {
+      batch_params[0], batch_params[1], batch_params[2],
+      batch_params[3], batch_params[4], batch_params[5],
+      batch_params[6], batch_params[7],
+   };
+}
+
+static void
+print_usage(FILE *f)
+{
+   fprintf(f,
+      "usage: esbench [options]\n"
+      "\n"
+      "  -c, --cpu <cpu>         Pin to <cpu> (default: the current one), or\n"
+      "                          -1 to not pin.\n"
+      "  -r, --reps <n>          Timed repetitions per case (default: 31).\n"
+      "  -w, --warmup-ms <ms>    Warm-up time per case (default: 50).\n"
+      "      --rep-ms <ms>       Time per repetition (default: 5).\n"
+      "  -t, --threads <n>       Largest thread count for the batch functions\n"
+      "                          (default: the number of online CPUs).\n"
+      "  -o, --output <file>     Write the JSON report to <file> instead of\n"
+      "                          stdout.\n");
+}
+
+static int
+parse_int(const char *arg, const char *name, int min, int max)
+{
+   char *end;
+   long n;
+
+   errno = 0;
+   n = strtol(arg, &end, 10);
+   if (errno || end == arg || *end != '\0' || n < min || n > max) {
+      fprintf(stderr, "esbench: %s takes a number between %d and %d\n",
+              name, min, max);
+      exit(2);
+   }
+
+   return n;
+}
+
+enum {
+   OPT_REP_MS = 256,
+};
+
+int
+main(int argc, char *argv[])
+{
+   static const struct option long_options[] = {
+      { "cpu",       required_argument, NULL, 'c' },
+      { "reps",      required_argument, NULL, 'r' },
+      { "warmup-ms", required_argument, NULL, 'w' },
+      { "rep-ms",    required_argument, NULL, OPT_REP_MS },
+      { "threads",   required_argument, NULL, 't' },
+      { "output",    required_argument, NULL, 'o' },
+      { "help",      no_argument,       NULL, 'h' },
+      { 0 }
+   };
+   int reps = 31, max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+   double warmup_ms = 50.0, rep_ms = 5.0;
+   const char *output = NULL;
+   int opt, ret = 0;
+
+   pin_cpu = sched_getcpu();
+   if (max_threads < 1)
+      max_threads = 1;
+   if (max_threads > ES_BATCH_MAX_THREADS)
+      max_threads = ES_BATCH_MAX_THREADS;
+
+   while ((opt = getopt_long(argc, argv, "c:r:w:t:o:h", long_options, NULL)) != -1) {
+      switch (opt) {
+      case 'c':
+         pin_cpu = parse_int(optarg, "--cpu", -1, CPU_SETSIZE - 1);
+         break;
+      case 'r':
+         reps = parse_int(optarg, "--reps", 1, MAX_REPS);
+         break;
+      case 'w':
+         warmup_ms = parse_int(optarg, "--warmup-ms", 1, 60000);
+         break;
+      case OPT_REP_MS:
+         rep_ms = parse_int(optarg, "--rep-ms", 1, 60000);
+         break;
+      case 't':
+         max_threads = parse_int(optarg, "--threads", 1, ES_BATCH_MAX_THREADS);
+         break;
+      case 'o':
+         output = optarg;
+         break;
+      case 'h':
+         print_usage(stdout);
+         return 0;
+      default:
+         print_usage(stderr);
+         return 2;
+      }
+   }
+
+   sched_getaffinity(0, sizeof(all_cpus), &all_cpus);
+   if (pin_cpu >= 0) {
+      cpu_set_t set;
+
+      CPU_ZERO(&set);
+      CPU_SET(pin_cpu, &set);
+      if (sched_setaffinity(0, sizeof(set), &set) != 0)
+         fail("cannot pin to the requested cpu");
+   }
+
+   init_data();
+
+   FILE *f = stdout;
+   if (output && !(f = fopen(output, "w")))
+      fail("cannot open the output file");
+
+   fprintf(f, "{\n");
+   fprintf(f, "  \"compiler\": \"%s\",\n", __VERSION__);
+   fprintf(f, "  \"flags\": \"%s\",\n", ESBENCH_FLAGS);
+   fprintf(f, "  \"cpu\": %d,\n", pin_cpu);
+   fprintf(f, "  \"repetitions\": %d,\n", reps);
+   fprintf(f, "  \"default_kernel\": \"%s\",\n", esKernelName(esGetKernel()));
+
+   fprintf(f, "  \"checks\": [\n");
+   bool first = true;
+   for (int k = 0; k < ES_KERNEL_COUNT; k++) {
+      if (!esKernelSupported(k))
+         continue;
+      esSetKernel(k);
+
+      double ulp = check_multiply();
+      bool exact = check_exact();
+      bool compose = check_compose();
+      bool batch = check_multiply_batch();
+      double quat = check_quaternion();
+
+      if (ulp > 6.0 || !exact || !compose || !batch || quat > 1e-5)
+         ret = 1;
+
+      fprintf(f, "%s    { \"kernel\": \"%s\", \"multiply_max_ulp\": %.2f, "
+                 "\"translate_scale_exact\": %s, \"compose_batch_exact\": %s, "
+                 "\"multiply_batch_exact\": %s, \"quaternion_max_error\": %.3g }",
+              first ? "" : ",\n", esKernelName(k), ulp,
+              exact ? "true" : "false", compose ? "true" : "false",
+              batch ? "true" : "false", quat);
+      first = false;
+   }
+   fprintf(f, "\n  ],\n");
+
+   /* speedup_p50 is against the scalar kernel on one thread. */
+   fprintf(f, "  \"results\": [\n");
+   first = true;
+   for (unsigned i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+      const struct bench_case *c = &cases[i];
+      int case_threads = c->batched ? max_threads : 1;
+      double scalar_p50 = 0.0;
+
+      for (int k = 0; k < ES_KERNEL_COUNT; k++) {
+         if (!esKernelSupported(k))
+            continue;
+         if (!c->per_kernel && k != ES_KERNEL_SCALAR)
+            continue;
+         esSetKernel(k);
+
+         /* Powers of two, and the largest count even if it is not one. */
+         for (int threads = 1;; threads = threads * 2 < case_threads ?
+                                          threads * 2 : case_threads) {
+            int used = set_threads(threads);
+            struct result r = measure(c, reps, warmup_ms, rep_ms);
+
+            if (k == ES_KERNEL_SCALAR && threads == 1)
+               scalar_p50 = r.p50;
+
+            fprintf(f, "%s    { \"name\": \"%s\", \"kernel\": \"%s\", "
+                       "\"threads\": %d, \"ns_per_op\": { \"min\": %.3f, "
+                       "\"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, "
+                       "\"max\": %.3f, \"mean\": %.3f }, "
+                       "\"speedup_p50\": %.3f }",
+                    first ? "" : ",\n", c->name,
+                    c->per_kernel ? esKernelName(k) : "any", used,
+                    r.min, r.p50, r.p90, r.p99, r.max, r.mean,
+                    scalar_p50 / r.p50);
+            first = false;
+
+            if (threads >= case_threads)
+               break;
+         }
+         set_threads(1);
+      }
+   }
+   fprintf(f, "\n  ]\n");
+   fprintf(f, "}\n");
+
+   if (f != stdout)
+      fclose(f);
+
+   free(batch_a);
+   free(batch_out);
+   free(batch_normal);
+
+   return ret;
+}
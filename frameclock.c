@@ -0,0 +1,27 @@
+/* The animation clock. render_cube() asks it for the time of each frame it
+ * builds. By default that is CLOCK_MONOTONIC time since start, so the
+ * animation follows real time without the jumps a wall clock takes. With
+ * --fixed-dt, frame n is at n * dt whatever the frame rate, so benchmarks
+ * and headless output render the same frames on every run and machine.
+ */
+
+#include "common.h"
+
+void
+frame_clock_init(struct frame_clock *clock, uint64_t fixed_dt_ns)
+{
+   clock->start_ns = bench_now();
+   clock->fixed_dt_ns = fixed_dt_ns;
+   clock->frames = 0;
+}
+
+uint64_t
+frame_clock_next(struct frame_clock *clock)
+{
+   uint64_t frame = clock->frames++;
+
+   if (clock->fixed_dt_ns)
+      return frame * clock->fixed_dt_ns;
+
+   return bench_now() - clock->start_ns;
+}
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include <dlfcn.h>
 #include <vulkan/vulkan.h>
 #include "vkhelper.h"
@@ -10,6 +11,8 @@
 #define TEXTURE_IMAGE_WIDTH	(256)
 #define TEXTURE_IMAGE_HEIGHT	(256)
 #define TEXTURE_IMAGE_SIZE	(TEXTURE_IMAGE_WIDTH * TEXTURE_IMAGE_HEIGHT * 4)
+#define UPLOAD_BENCH_ENV	"HOOK_UPLOAD_BENCH"	/* number of buffers to upload */
+#define UPLOAD_BENCH_SIZE	(4096)
 
 
 struct hook_context
@@ -79,9 +82,60 @@ void vulkan_api_destroy(struct vulkan_api* vulkan)
 }
 
 
+static double hook_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+
+/* Upload count small vertex buffers one by one, then as one batch, and
+ * print how long each took until the GPU was done */
+static void hook_upload_bench(vkhelper_device* device, int count)
+{
+	int i;
+	int batched;
+	double start;
+	double elapsed[2];
+	char* data = NULL;
+	vkhelper_buffer** buffers = NULL;
+
+	data = calloc(1, UPLOAD_BENCH_SIZE);
+	buffers = calloc(count, sizeof(vkhelper_buffer*));
+
+	for(batched = 0;batched < 2;++batched)
+	{
+		start = hook_now_ms();
+
+		if(batched)
+			vkhelper_device_begin_upload_batch(device);
+		for(i = 0;i < count;++i)
+			buffers[i] = vkhelper_vertex_buffer_create(device, data, UPLOAD_BENCH_SIZE);
+		if(batched)
+			vkhelper_device_end_upload_batch(device);
+		vkhelper_device_wait_uploads(device);
+
+		elapsed[batched] = hook_now_ms() - start;
+
+		for(i = 0;i < count;++i)
+			vkhelper_buffer_destroy(device, buffers[i]);
+	}
+
+	fprintf(stderr, "[HOOK] upload: %d x %d bytes, %.3f ms one by one, %.3f ms batched\n",
+		count, UPLOAD_BENCH_SIZE, elapsed[0], elapsed[1]);
+
+	free(buffers);
+	free(data);
+}
+
+
 struct hook_context* hook_init(VkPhysicalDevice phydevice, VkDevice device, int queuefamily)
 {
 	struct hook_context*	hook = NULL;
+	vkhelper_memory_stats	stats;
+
 	hook = calloc(1, sizeof(struct hook_context));
 
 	hook->device = vkhelper_device_create_with_vkdevice(phydevice, device, queuefamily);
@@ -135,6 +189,7 @@ struct hook_context* hook_init(VkPhysicalDevice phydevice, VkDevice device, int
 			.borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK,
 			.compareOp = VK_COMPARE_OP_ALWAYS,
 			.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR,
+			.maxLod = VK_LOD_CLAMP_NONE,
 		},
 		NULL, &hook->sampler
 	);
@@ -179,10 +234,18 @@ struct hook_context* hook_init(VkPhysicalDevice phydevice, VkDevice device, int
 	fread(image_data, TEXTURE_IMAGE_SIZE, 1, fp);
 	fclose(fp);
 
-	hook->texture = vkhelper_image_create(hook->device, image_data, TEXTURE_IMAGE_WIDTH, TEXTURE_IMAGE_HEIGHT);
+	hook->texture = vkhelper_image_create(hook->device, image_data, TEXTURE_IMAGE_WIDTH, TEXTURE_IMAGE_HEIGHT, VK_TRUE);
 
 	free(image_data);
 
+	vkhelper_device_get_memory_stats(hook->device, &stats);
+	fprintf(stderr, "[HOOK] memory: %u allocations in %u blocks, %llu of %llu bytes used, fragmentation %.2f\n",
+		stats.nr_allocations, stats.nr_blocks,
+		(unsigned long long)stats.bytes_used, (unsigned long long)stats.bytes_reserved, stats.fragmentation);
+
+	if(getenv(UPLOAD_BENCH_ENV))
+		hook_upload_bench(hook->device, atoi(getenv(UPLOAD_BENCH_ENV)));
+
 	return hook;
 }
 
@@ -191,6 +254,9 @@ void hook_destroy(struct hook_context* hook)
 {
 	VkDevice device = vkhelper_device_get_vkdevice(hook->device);
 
+	/* The texture upload may still be in flight */
+	vkhelper_device_wait_uploads(hook->device);
+
 	vkDestroyPipeline(device, hook->pipeline, NULL);
 	vkDestroyPipelineLayout(device, hook->pipelinelayout, NULL);
 	vkDestroySampler(device, hook->sampler, NULL);
@@ -295,6 +361,7 @@ VKAPI_ATTR VkResult VKAPI_CALL vkQueuePresentKHR(VkQueue queue, const VkPresentI
 		0, NULL
 	);
 
+	vkhelper_cmd_acquire_uploads(context->device, cmdbuf);
 	vkhelper_begin_renderpass(cmdbuf, context->renderpass, context->index);
 
 	vkCmdBindPipeline(cmdbuf, VK_PIPELINE_BIND_POINT_GRAPHICS, context->pipeline);
@@ -41,6 +41,7 @@
 #include <stdio.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <errno.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
@@ -56,16 +57,37 @@
 #include <assert.h>
 #include <sys/mman.h>
 #include <linux/input.h>
+#include <inttypes.h>
+#include <png.h>
 
 #include "common.h"
+#include "pipelinecache.h"
 
 enum display_mode {
    DISPLAY_MODE_AUTO = 0,
+   DISPLAY_MODE_HEADLESS,
    DISPLAY_MODE_XCB,
    DISPLAY_MODE_KHR,
 };
 
 static enum display_mode display_mode = DISPLAY_MODE_AUTO;
+static uint32_t frames_in_flight = 2;
+static uint32_t cube_count = 1;
+static uint32_t headless_frames = 1;
+static const char *output_file = "./cube.png";
+static uint32_t bench_frames = 0;
+static uint32_t bench_warmup = 60;
+static const char *bench_output = NULL;
+static bool prerecord = false;
+static bool push_constants = false;
+static bool interleaved = false;
+static bool compact_vertices = false;
+static bool gpu_cull = false;
+static bool gpu_animate = false;
+static uint32_t transform_threads = 1;
+static uint64_t fixed_dt_ns = 0;
+static bool startup_profile = false;
+static const char *startup_output = NULL;
 
 void noreturn
 failv(const char *format, va_list args)
@@ -116,6 +138,7 @@ init_vk(struct vkcube *vc, const char *extension)
       },
       NULL,
       &vc->instance);
+   startup_mark(vc, "instance");
 
    uint32_t count;
    vkEnumeratePhysicalDevices(vc->instance, &count, NULL);
@@ -123,12 +146,11 @@ init_vk(struct vkcube *vc, const char *extension)
    VkPhysicalDevice pd[count];
    vkEnumeratePhysicalDevices(vc->instance, &count, pd);
    vc->physical_device = pd[0];
-   printf("%d physical devices\n", count);
+   fprintf(stderr, "%d physical devices\n", count);
 
-   VkPhysicalDeviceProperties properties;
-   vkGetPhysicalDeviceProperties(vc->physical_device, &properties);
-   printf("vendor id %04x, device name %s\n",
-          properties.vendorID, properties.deviceName);
+   vkGetPhysicalDeviceProperties(vc->physical_device, &vc->properties);
+   fprintf(stderr, "vendor id %04x, device name %s\n",
+           vc->properties.vendorID, vc->properties.deviceName);
 
    vkGetPhysicalDeviceMemoryProperties(vc->physical_device, &vc->memory_properties);
 
@@ -137,6 +159,8 @@ init_vk(struct vkcube *vc, const char *extension)
    VkQueueFamilyProperties props[count];
    vkGetPhysicalDeviceQueueFamilyProperties(vc->physical_device, &count, props);
    assert(props[0].queueFlags & VK_QUEUE_GRAPHICS_BIT);
+   vc->timestamp_valid_bits = props[0].timestampValidBits;
+   startup_mark(vc, "physical_device");
 
    vkCreateDevice(vc->physical_device,
                   &(VkDeviceCreateInfo) {
@@ -148,7 +172,7 @@ init_vk(struct vkcube *vc, const char *extension)
                         .queueCount = 1,
                         .pQueuePriorities = (float []) { 1.0f },
                      },
-                     .enabledExtensionCount = 1,
+                     .enabledExtensionCount = extension ? 1 : 0,
                      .ppEnabledExtensionNames = (const char * const []) {
                         VK_KHR_SWAPCHAIN_EXTENSION_NAME,
                      },
@@ -157,15 +181,21 @@ init_vk(struct vkcube *vc, const char *extension)
                   &vc->device);
 
    vkGetDeviceQueue(vc->device, 0, 0, &vc->queue);
+   startup_mark(vc, "device");
 }
 
 static void
 init_vk_objects(struct vkcube *vc)
 {
+   /* A single cube gets by with back face culling; more need depth testing.
+    * D16 is supported as a depth attachment everywhere. */
+   vc->depth_format = vc->instance_count > 1 ?
+                      VK_FORMAT_D16_UNORM : VK_FORMAT_UNDEFINED;
+
    vkCreateRenderPass(vc->device,
       &(VkRenderPassCreateInfo) {
          .sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO,
-         .attachmentCount = 1,
+         .attachmentCount = vc->depth_format ? 2 : 1,
          .pAttachments = (VkAttachmentDescription[]) {
             {
                .format = vc->image_format,
@@ -173,7 +203,19 @@ init_vk_objects(struct vkcube *vc)
                .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
                .storeOp = VK_ATTACHMENT_STORE_OP_STORE,
                .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-               .finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+               .finalLayout = display_mode == DISPLAY_MODE_HEADLESS ?
+                              VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL :
+                              VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+            },
+            {
+               .format = vc->depth_format,
+               .samples = 1,
+               .loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+               .storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+               .stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
+               .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
+               .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+               .finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
             }
          },
          .subpassCount = 1,
@@ -194,7 +236,11 @@ init_vk_objects(struct vkcube *vc)
                      .layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL
                   }
                },
-               .pDepthStencilAttachment = NULL,
+               .pDepthStencilAttachment = vc->depth_format ?
+                  &(VkAttachmentReference) {
+                     .attachment = 1,
+                     .layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL
+                  } : NULL,
                .preserveAttachmentCount = 0,
                .pPreserveAttachments = NULL,
             }
@@ -204,8 +250,11 @@ init_vk_objects(struct vkcube *vc)
       NULL,
       &vc->render_pass);
 
-   vc->model.init(vc);
+   vc->pipeline_cache = pipelinecache_load(vc->physical_device, vc->device,
+                                           "vkcube");
+   startup_mark(vc, "pipeline_cache");
 
+   /* The model uploads its geometry through this pool. */
    vkCreateCommandPool(vc->device,
                        &(const VkCommandPoolCreateInfo) {
                           .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
@@ -215,6 +264,9 @@ init_vk_objects(struct vkcube *vc)
                        NULL,
                        &vc->cmd_pool);
 
+   vc->model.init(vc);
+   startup_mark(vc, "model_init");
+
    vkCreateSemaphore(vc->device,
                      &(VkSemaphoreCreateInfo) {
                         .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
@@ -223,6 +275,75 @@ init_vk_objects(struct vkcube *vc)
                      &vc->semaphore);
 }
 
+int
+find_memory_type(struct vkcube *vc, uint32_t allowed, VkMemoryPropertyFlags flags)
+{
+   for (uint32_t i = 0; i < vc->memory_properties.memoryTypeCount; i++) {
+      if ((allowed & (1u << i)) &&
+          (vc->memory_properties.memoryTypes[i].propertyFlags & flags) == flags)
+         return i;
+   }
+
+   return -1;
+}
+
+static void
+init_depth_buffer(struct vkcube *vc, struct vkcube_buffer *b)
+{
+   vkCreateImage(vc->device,
+      &(VkImageCreateInfo) {
+         .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+         .imageType = VK_IMAGE_TYPE_2D,
+         .format = vc->depth_format,
+         .extent = { vc->width, vc->height, 1 },
+         .mipLevels = 1,
+         .arrayLayers = 1,
+         .samples = 1,
+         .tiling = VK_IMAGE_TILING_OPTIMAL,
+         .usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
+         .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+         .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+      },
+      NULL,
+      &b->depth_image);
+
+   VkMemoryRequirements reqs;
+   vkGetImageMemoryRequirements(vc->device, b->depth_image, &reqs);
+
+   int memory_type = find_memory_type(vc, reqs.memoryTypeBits,
+                                      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+   if (memory_type < 0)
+      memory_type = find_memory_type(vc, reqs.memoryTypeBits, 0);
+   fail_if(memory_type < 0, "No memory type for the depth buffer");
+
+   vkAllocateMemory(vc->device,
+                    &(VkMemoryAllocateInfo) {
+                       .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+                       .allocationSize = reqs.size,
+                       .memoryTypeIndex = memory_type,
+                    },
+                    NULL,
+                    &b->depth_mem);
+   vkBindImageMemory(vc->device, b->depth_image, b->depth_mem, 0);
+
+   vkCreateImageView(vc->device,
+                     &(VkImageViewCreateInfo) {
+                        .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+                        .image = b->depth_image,
+                        .viewType = VK_IMAGE_VIEW_TYPE_2D,
+                        .format = vc->depth_format,
+                        .subresourceRange = {
+                           .aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT,
+                           .baseMipLevel = 0,
+                           .levelCount = 1,
+                           .baseArrayLayer = 0,
+                           .layerCount = 1,
+                        },
+                     },
+                     NULL,
+                     &b->depth_view);
+}
+
 static void
 init_buffer(struct vkcube *vc, struct vkcube_buffer *b)
 {
@@ -249,12 +370,18 @@ init_buffer(struct vkcube *vc, struct vkcube_buffer *b)
                      NULL,
                      &b->view);
 
+   if (vc->depth_format)
+      init_depth_buffer(vc, b);
+
    vkCreateFramebuffer(vc->device,
                        &(VkFramebufferCreateInfo) {
                           .sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
                           .renderPass = vc->render_pass,
-                          .attachmentCount = 1,
-                          .pAttachments = &b->view,
+                          .attachmentCount = vc->depth_format ? 2 : 1,
+                          .pAttachments = (VkImageView[]) {
+                             b->view,
+                             b->depth_view,
+                          },
                           .width = vc->width,
                           .height = vc->height,
                           .layers = 1
@@ -278,15 +405,59 @@ init_buffer(struct vkcube *vc, struct vkcube_buffer *b)
          .commandBufferCount = 1,
       },
       &b->cmd_buffer);
+
+   /* Begin/end of the render pass, then of the compute passes before it,
+    * read back once the fence says the buffer's previous frame is done. */
+   if (vc->bench && vc->timestamp_valid_bits > 0) {
+      vkCreateQueryPool(vc->device,
+                        &(VkQueryPoolCreateInfo) {
+                           .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+                           .queryType = VK_QUERY_TYPE_TIMESTAMP,
+                           .queryCount = 4,
+                        },
+                        NULL,
+                        &b->query_pool);
+      b->query_pending = false;
+   }
+
+   /* Headless buffers are never acquired or presented. */
+   if (display_mode == DISPLAY_MODE_HEADLESS)
+      return;
+
+   vkCreateSemaphore(vc->device,
+                     &(VkSemaphoreCreateInfo) {
+                        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+                     },
+                     NULL,
+                     &b->acquire_semaphore);
+
+   vkCreateSemaphore(vc->device,
+                     &(VkSemaphoreCreateInfo) {
+                        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+                     },
+                     NULL,
+                     &b->render_semaphore);
 }
 
 static void
 destroy_buffer(struct vkcube *vc, struct vkcube_buffer *b)
 {
+	vkDestroyQueryPool(vc->device, b->query_pool, NULL);
+	b->query_pool = VK_NULL_HANDLE;
+	vkDestroySemaphore(vc->device, b->render_semaphore, NULL);
+	vkDestroySemaphore(vc->device, b->acquire_semaphore, NULL);
 	vkFreeCommandBuffers(vc->device, vc->cmd_pool, 1, &b->cmd_buffer);
+	b->recorded = false;
+	b->cull_pending = false;
 	vkDestroyFence(vc->device, b->fence, NULL);
 	vkDestroyFramebuffer(vc->device, b->framebuffer, NULL);
 	vkDestroyImageView(vc->device, b->view, NULL);
+	vkDestroyImageView(vc->device, b->depth_view, NULL);
+	vkDestroyImage(vc->device, b->depth_image, NULL);
+	vkFreeMemory(vc->device, b->depth_mem, NULL);
+	b->depth_view = VK_NULL_HANDLE;
+	b->depth_image = VK_NULL_HANDLE;
+	b->depth_mem = VK_NULL_HANDLE;
 }
 
 /* Swapchain-based code - shared between XCB and Wayland */
@@ -356,6 +527,19 @@ create_swapchain(struct vkcube *vc)
       }
    }
 
+   /* Benchmarks want to measure the renderer, not the refresh rate. */
+   if (vc->bench) {
+      for (i = 0; i < count; i++) {
+         if (present_modes[i] == VK_PRESENT_MODE_IMMEDIATE_KHR) {
+            present_mode = VK_PRESENT_MODE_IMMEDIATE_KHR;
+            break;
+         }
+         if (present_modes[i] == VK_PRESENT_MODE_MAILBOX_KHR)
+            present_mode = VK_PRESENT_MODE_MAILBOX_KHR;
+      }
+   }
+   vc->present_mode = present_mode;
+
    uint32_t minImageCount = 2;
    if (minImageCount < surface_caps.minImageCount) {
       if (surface_caps.minImageCount > MAX_NUM_IMAGES)
@@ -399,6 +583,331 @@ create_swapchain(struct vkcube *vc)
       vc->buffers[i].image = swap_chain_images[i];
       init_buffer(vc, &vc->buffers[i]);
    }
+   startup_mark(vc, "swapchain");
+}
+
+static void
+destroy_swapchain(struct vkcube *vc)
+{
+   /* Frames may still be in flight now that presents no longer idle the
+    * queue. */
+   vkDeviceWaitIdle(vc->device);
+
+   for (uint32_t i = 0; i < vc->image_count; i++)
+      destroy_buffer(vc, &vc->buffers[i]);
+   vkDestroySwapchainKHR(vc->device, vc->swap_chain, NULL);
+
+   memset(vc->inflight, 0, sizeof(vc->inflight));
+   vc->image_count = 0;
+}
+
+/* Block until at most frames_in_flight - 1 frames are queued, so the next
+ * one can be recorded while the GPU works on the others. */
+static void
+throttle_frame(struct vkcube *vc)
+{
+   struct vkcube_buffer *b = vc->inflight[vc->frame % vc->frames_in_flight];
+
+   if (b)
+      vkWaitForFences(vc->device, 1, &b->fence, VK_TRUE, UINT64_MAX);
+   bench_mark(vc, BENCH_PHASE_WAIT);
+}
+
+/* vkAcquireNextImageKHR signals vc->semaphore before we know which buffer it
+ * belongs to. Hand it to the buffer and take back the buffer's old acquire
+ * semaphore as the next spare; that one is unused again once the buffer's
+ * previous submission has retired. */
+static struct vkcube_buffer *
+begin_frame(struct vkcube *vc, uint32_t index)
+{
+   struct vkcube_buffer *b = &vc->buffers[index];
+   VkSemaphore acquired = vc->semaphore;
+
+   vkWaitForFences(vc->device, 1, &b->fence, VK_TRUE, UINT64_MAX);
+   vc->semaphore = b->acquire_semaphore;
+   b->acquire_semaphore = acquired;
+   bench_mark(vc, BENCH_PHASE_WAIT);
+
+   return b;
+}
+
+static VkResult
+present_frame(struct vkcube *vc, struct vkcube_buffer *b, uint32_t index)
+{
+   VkResult result;
+
+   vkQueuePresentKHR(vc->queue,
+      &(VkPresentInfoKHR) {
+         .sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
+         .waitSemaphoreCount = 1,
+         .pWaitSemaphores = &b->render_semaphore,
+         .swapchainCount = 1,
+         .pSwapchains = (VkSwapchainKHR[]) { vc->swap_chain, },
+         .pImageIndices = (uint32_t[]) { index, },
+         .pResults = &result,
+      });
+   bench_mark(vc, BENCH_PHASE_PRESENT);
+   startup_finish(vc, "first_present");
+
+   vc->inflight[vc->frame % vc->frames_in_flight] = b;
+   vc->frame++;
+
+   return result;
+}
+
+/* Headless code - render offscreen to device-local images */
+
+// Return -1 on failure.
+static int
+init_headless(struct vkcube *vc)
+{
+   init_vk(vc, NULL);
+   vc->image_format = VK_FORMAT_R8G8B8A8_SRGB;
+   init_vk_objects(vc);
+
+   /* One image per frame in flight, so consecutive frames don't have to
+    * wait for each other. */
+   vc->image_count = vc->frames_in_flight;
+   for (uint32_t i = 0; i < vc->image_count; i++) {
+      struct vkcube_buffer *b = &vc->buffers[i];
+
+      vkCreateImage(vc->device,
+         &(VkImageCreateInfo) {
+            .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+            .imageType = VK_IMAGE_TYPE_2D,
+            .format = vc->image_format,
+            .extent = { vc->width, vc->height, 1 },
+            .mipLevels = 1,
+            .arrayLayers = 1,
+            .samples = 1,
+            .tiling = VK_IMAGE_TILING_OPTIMAL,
+            .usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+                     VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+            .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+            .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+         },
+         NULL,
+         &b->image);
+
+      VkMemoryRequirements reqs;
+      vkGetImageMemoryRequirements(vc->device, b->image, &reqs);
+
+      int memory_type = find_memory_type(vc, reqs.memoryTypeBits,
+                                         VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+      if (memory_type < 0)
+         memory_type = find_memory_type(vc, reqs.memoryTypeBits, 0);
+      if (memory_type < 0) {
+         fprintf(stderr, "No memory type for the render target\n");
+         return -1;
+      }
+
+      vkAllocateMemory(vc->device,
+                       &(VkMemoryAllocateInfo) {
+                          .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+                          .allocationSize = reqs.size,
+                          .memoryTypeIndex = memory_type,
+                       },
+                       NULL,
+                       &b->mem);
+
+      vkBindImageMemory(vc->device, b->image, b->mem, 0);
+
+      b->stride = vc->width * 4;
+      init_buffer(vc, b);
+   }
+   startup_mark(vc, "images");
+
+   return 0;
+}
+
+static void
+destroy_headless(struct vkcube *vc)
+{
+   vkDeviceWaitIdle(vc->device);
+
+   for (uint32_t i = 0; i < vc->image_count; i++) {
+      destroy_buffer(vc, &vc->buffers[i]);
+      vkDestroyImage(vc->device, vc->buffers[i].image, NULL);
+      vkFreeMemory(vc->device, vc->buffers[i].mem, NULL);
+   }
+
+   memset(vc->inflight, 0, sizeof(vc->inflight));
+   vc->image_count = 0;
+}
+
+static void
+write_png(const char *path, int32_t width, int32_t height, int32_t stride,
+          void *pixels)
+{
+   FILE *f = NULL;
+   png_structp png_writer = NULL;
+   png_infop png_info = NULL;
+
+   uint8_t *rows[height];
+
+   for (int32_t h = 0; h < height; ++h)
+      rows[h] = (uint8_t *) pixels + h * stride;
+
+   png_writer = png_create_write_struct(PNG_LIBPNG_VER_STRING,
+                                        NULL, NULL, NULL);
+   fail_if(!png_writer, "failed to create png writer");
+
+   png_info = png_create_info_struct(png_writer);
+   fail_if(!png_info, "failed to create png writer info");
+
+   f = fopen(path, "wb");
+   fail_if(!f, "failed to open file for writing: %s", path);
+
+   png_init_io(png_writer, f);
+   png_set_IHDR(png_writer, png_info,
+                width, height,
+                8, PNG_COLOR_TYPE_RGBA,
+                PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+                PNG_FILTER_TYPE_DEFAULT);
+   png_write_info(png_writer, png_info);
+   png_write_image(png_writer, rows);
+   png_write_end(png_writer, NULL);
+
+   png_destroy_write_struct(&png_writer, &png_info);
+
+   fclose(f);
+}
+
+/* Copy the image of buffer b into host memory and write it out as png. The
+ * render pass leaves headless images in TRANSFER_SRC_OPTIMAL. */
+static void
+write_buffer(struct vkcube *vc, struct vkcube_buffer *b)
+{
+   VkDeviceSize size = (VkDeviceSize) b->stride * vc->height;
+   VkBuffer buffer;
+   VkDeviceMemory mem;
+   void *map;
+
+   vkCreateBuffer(vc->device,
+                  &(VkBufferCreateInfo) {
+                     .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+                     .size = size,
+                     .usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                     .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+                  },
+                  NULL,
+                  &buffer);
+
+   VkMemoryRequirements reqs;
+   vkGetBufferMemoryRequirements(vc->device, buffer, &reqs);
+
+   int memory_type = find_memory_type(vc, reqs.memoryTypeBits,
+                                      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                      VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+   if (memory_type < 0)
+      fail("no host visible memory for readback");
+
+   vkAllocateMemory(vc->device,
+                    &(VkMemoryAllocateInfo) {
+                       .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+                       .allocationSize = reqs.size,
+                       .memoryTypeIndex = memory_type,
+                    },
+                    NULL,
+                    &mem);
+   vkBindBufferMemory(vc->device, buffer, mem, 0);
+
+   vkWaitForFences(vc->device, 1, &b->fence, VK_TRUE, UINT64_MAX);
+   vkResetFences(vc->device, 1, &b->fence);
+
+   vkBeginCommandBuffer(b->cmd_buffer,
+                        &(VkCommandBufferBeginInfo) {
+                           .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+                           .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+                        });
+
+   vkCmdPipelineBarrier(b->cmd_buffer,
+                        VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+                        VK_PIPELINE_STAGE_TRANSFER_BIT,
+                        0, 0, NULL, 0, NULL, 1,
+                        &(VkImageMemoryBarrier) {
+                           .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+                           .srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+                           .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+                           .oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                           .newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                           .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                           .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+                           .image = b->image,
+                           .subresourceRange = {
+                              .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                              .levelCount = 1,
+                              .layerCount = 1,
+                           },
+                        });
+
+   vkCmdCopyImageToBuffer(b->cmd_buffer, b->image,
+                          VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, buffer, 1,
+                          &(VkBufferImageCopy) {
+                             .bufferOffset = 0,
+                             .bufferRowLength = b->stride / 4,
+                             .imageSubresource = {
+                                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                                .layerCount = 1,
+                             },
+                             .imageExtent = { vc->width, vc->height, 1 },
+                          });
+
+   vkCmdPipelineBarrier(b->cmd_buffer,
+                        VK_PIPELINE_STAGE_TRANSFER_BIT,
+                        VK_PIPELINE_STAGE_HOST_BIT,
+                        0, 1,
+                        &(VkMemoryBarrier) {
+                           .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+                           .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+                           .dstAccessMask = VK_ACCESS_HOST_READ_BIT,
+                        },
+                        0, NULL, 0, NULL);
+
+   vkEndCommandBuffer(b->cmd_buffer);
+   b->recorded = false;
+
+   vkQueueSubmit(vc->queue, 1,
+      &(VkSubmitInfo) {
+         .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+         .commandBufferCount = 1,
+         .pCommandBuffers = &b->cmd_buffer,
+      }, b->fence);
+   vkWaitForFences(vc->device, 1, &b->fence, VK_TRUE, UINT64_MAX);
+
+   vkMapMemory(vc->device, mem, 0, size, 0, &map);
+   fprintf(stderr, "writing frame %" PRIu64 " to %s\n", vc->frame, output_file);
+   write_png(output_file, vc->width, vc->height, b->stride, map);
+   vkUnmapMemory(vc->device, mem);
+
+   vkDestroyBuffer(vc->device, buffer, NULL);
+   vkFreeMemory(vc->device, mem, NULL);
+}
+
+static void
+mainloop_headless(struct vkcube *vc)
+{
+   struct vkcube_buffer *b = NULL;
+
+   for (uint32_t i = 0; i < headless_frames; i++) {
+      bench_begin_frame(vc);
+      throttle_frame(vc);
+
+      b = &vc->buffers[vc->frame % vc->image_count];
+      vc->model.render(vc, b);
+      bench_mark(vc, BENCH_PHASE_RENDER);
+      /* Nothing is presented; stop at the first submit. */
+      startup_finish(vc, "first_frame");
+
+      vc->inflight[vc->frame % vc->frames_in_flight] = b;
+      vc->frame++;
+
+      if (bench_end_frame(vc))
+         break;
+   }
+
+   if (b)
+      write_buffer(vc, b);
 }
 
 /* XCB display code - render to X window */
@@ -429,8 +938,12 @@ init_xcb(struct vkcube *vc)
    static const char title[] = "Vulkan Cube";
 
    vc->xcb.conn = xcb_connect(0, 0);
-   if (xcb_connection_has_error(vc->xcb.conn))
+   if (xcb_connection_has_error(vc->xcb.conn)) {
+      xcb_disconnect(vc->xcb.conn);
+      vc->xcb.conn = NULL;
       return -1;
+   }
+   startup_mark(vc, "x_connect");
 
    vc->xcb.window = xcb_generate_id(vc->xcb.conn);
 
@@ -453,6 +966,7 @@ init_xcb(struct vkcube *vc)
                      XCB_WINDOW_CLASS_INPUT_OUTPUT,
                      iter.data->root_visual,
                      XCB_CW_EVENT_MASK, window_values);
+   startup_mark(vc, "x_window");
 
    vc->xcb.atom_wm_protocols = get_atom(vc->xcb.conn, "WM_PROTOCOLS");
    vc->xcb.atom_wm_delete_window = get_atom(vc->xcb.conn, "WM_DELETE_WINDOW");
@@ -475,6 +989,7 @@ init_xcb(struct vkcube *vc)
    xcb_map_window(vc->xcb.conn, vc->xcb.window);
 
    xcb_flush(vc->xcb.conn);
+   startup_mark(vc, "x_atoms");
 
    init_vk(vc, VK_KHR_XCB_SURFACE_EXTENSION_NAME);
 
@@ -497,8 +1012,10 @@ init_xcb(struct vkcube *vc)
          .connection = vc->xcb.conn,
          .window = vc->xcb.window,
       }, NULL, &vc->surface);
+   startup_mark(vc, "surface");
 
    vc->image_format = choose_surface_format(vc);
+   startup_mark(vc, "surface_format");
 
    init_vk_objects(vc);
 
@@ -555,13 +1072,8 @@ mainloop_xcb(struct vkcube *vc)
             configure = (xcb_configure_notify_event_t *) event;
             if (vc->width != configure->width ||
                 vc->height != configure->height) {
-               if (vc->image_count > 0) {
-                  vkDestroySwapchainKHR(vc->device, vc->swap_chain, NULL);
-		  int i;
-		  for(i = 0;i < vc->image_count;++i)
-		     destroy_buffer(vc, &vc->buffers[i]);
-                  vc->image_count = 0;
-               }
+               if (vc->image_count > 0)
+                  destroy_swapchain(vc);
 
                vc->width = configure->width;
                vc->height = configure->height;
@@ -586,13 +1098,19 @@ mainloop_xcb(struct vkcube *vc)
       }
 
       if (repaint) {
+         /* Time spent waiting for the window to be mapped and exposed. */
+         startup_mark(vc, "x_expose");
          if (vc->image_count == 0)
             create_swapchain(vc);
 
+         bench_begin_frame(vc);
+         throttle_frame(vc);
+
          uint32_t index;
          VkResult result;
          result = vkAcquireNextImageKHR(vc->device, vc->swap_chain, 60,
                                         vc->semaphore, VK_NULL_HANDLE, &index);
+         bench_mark(vc, BENCH_PHASE_ACQUIRE);
          switch (result) {
          case VK_SUCCESS:
             break;
@@ -605,19 +1123,15 @@ mainloop_xcb(struct vkcube *vc)
             return;
          }
 
-         assert(index <= MAX_NUM_IMAGES);
-         vc->model.render(vc, &vc->buffers[index]);
-
-         vkQueuePresentKHR(vc->queue,
-             &(VkPresentInfoKHR) {
-                .sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
-                .swapchainCount = 1,
-                .pSwapchains = (VkSwapchainKHR[]) { vc->swap_chain, },
-                .pImageIndices = (uint32_t[]) { index, },
-                .pResults = &result,
-             });
+         assert(index < MAX_NUM_IMAGES);
+         struct vkcube_buffer *b = begin_frame(vc, index);
+         vc->model.render(vc, b);
+         bench_mark(vc, BENCH_PHASE_RENDER);
+         startup_mark(vc, "first_frame");
+         present_frame(vc, b, index);
 
-         vkQueueWaitIdle(vc->queue);
+         if (bench_end_frame(vc))
+            return;
 
          schedule_xcb_repaint(vc);
       }
@@ -636,7 +1150,6 @@ init_khr(struct vkcube *vc)
 {
    init_vk(vc, VK_KHR_DISPLAY_EXTENSION_NAME);
    vc->image_format = VK_FORMAT_B8G8R8A8_SRGB;
-   init_vk_objects(vc);
 
    /* */
    uint32_t display_count = 0;
@@ -817,6 +1330,7 @@ init_khr(struct vkcube *vc)
                                      &display_plane_surface_create_info,
                                      NULL,
                                      &vc->surface);
+   startup_mark(vc, "surface");
 
    vc->width = modes[display_mode_idx].parameters.visibleRegion.width;
    vc->height = modes[display_mode_idx].parameters.visibleRegion.height;
@@ -836,27 +1350,28 @@ static void
 mainloop_khr(struct vkcube *vc)
 {
    while (1) {
+      bench_begin_frame(vc);
+      throttle_frame(vc);
+
       uint32_t index;
       VkResult result = vkAcquireNextImageKHR(vc->device, vc->swap_chain, UINT64_MAX,
                                      vc->semaphore, VK_NULL_HANDLE, &index);
       if (result != VK_SUCCESS)
          return;
+      bench_mark(vc, BENCH_PHASE_ACQUIRE);
+
+      assert(index < MAX_NUM_IMAGES);
+      struct vkcube_buffer *b = begin_frame(vc, index);
+      vc->model.render(vc, b);
+      bench_mark(vc, BENCH_PHASE_RENDER);
+      startup_mark(vc, "first_frame");
 
-      assert(index <= MAX_NUM_IMAGES);
-      vc->model.render(vc, &vc->buffers[index]);
-
-      vkQueuePresentKHR(vc->queue,
-         &(VkPresentInfoKHR) {
-            .sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
-            .swapchainCount = 1,
-            .pSwapchains = (VkSwapchainKHR[]) { vc->swap_chain, },
-            .pImageIndices = (uint32_t[]) { index, },
-            .pResults = &result,
-         });
+      result = present_frame(vc, b, index);
       if (result != VK_SUCCESS)
          return;
 
-      vkQueueWaitIdle(vc->queue);
+      if (bench_end_frame(vc))
+         return;
    }
 }
 
@@ -868,6 +1383,9 @@ display_mode_from_string(const char *s, enum display_mode *mode)
    if (streq(s, "auto")) {
       *mode = DISPLAY_MODE_AUTO;
       return true;
+   } else if (streq(s, "headless")) {
+      *mode = DISPLAY_MODE_HEADLESS;
+      return true;
    } else if (streq(s, "xcb")) {
       *mode = DISPLAY_MODE_XCB;
       return true;
@@ -883,7 +1401,7 @@ static void
 print_usage(FILE *f)
 {
    const char *usage =
-      "usage: vkcube [-n] [-o <file>]\n"
+      "usage: vkcube [-n] [-o <file>] [-c <count>]\n"
       "\n"
       "  -n                      Don't initialize vt or kms, run headless. This\n"
       "                          option is equivalent to '-m headless'.\n"
@@ -897,8 +1415,61 @@ print_usage(FILE *f)
       "                          by the column character. To display the item\n"
       "                          corresponding to those number, just omit the number.\n"
       "\n"
+      "  -f <frames>             Number of frames the CPU may queue ahead of the\n"
+      "                          GPU, between 1 and 4. Default is 2; 1 waits for\n"
+      "                          each frame to finish before starting the next.\n"
+      "\n"
       "  -o <file>               Path to output image when running headless.\n"
       "                          Default is \"./cube.png\".\n"
+      "\n"
+      "  -c <count>              Draw <count> spinning cubes arranged in a grid,\n"
+      "                          as instances of a single cube. Default is 1.\n"
+      "\n"
+      "  --bench <frames>        Render <frames> frames after the warm-up, then\n"
+      "                          exit and report frame time statistics as JSON.\n"
+      "\n"
+      "  --bench-warmup <frames> Frames rendered before measuring starts. Default\n"
+      "                          is 60.\n"
+      "\n"
+      "  --bench-output <file>   Write the benchmark report to <file> instead of\n"
+      "                          stdout.\n"
+      "\n"
+      "  --prerecord             Record each image's command buffer once when the\n"
+      "                          swapchain is created instead of every frame.\n"
+      "\n"
+      "  --push-constants        Pass the transforms with push constants instead\n"
+      "                          of a uniform buffer. Incompatible with\n"
+      "                          '--prerecord'.\n"
+      "\n"
+      "  --interleaved           Store position, color and normal interleaved in\n"
+      "                          a single vertex binding instead of one binding\n"
+      "                          per attribute.\n"
+      "\n"
+      "  --compact-vertices      Store positions as half floats and colors and\n"
+      "                          normals as packed normalized integers, 16 bytes\n"
+      "                          per vertex instead of 36.\n"
+      "\n"
+      "  --gpu-cull              Cull the cubes against the view frustum in a\n"
+      "                          compute shader and draw the visible ones with\n"
+      "                          an indirect draw. Incompatible with\n"
+      "                          '--prerecord'.\n"
+      "\n"
+      "  --gpu-animate           Compute the per-cube transforms in a compute\n"
+      "                          shader instead of on the CPU. Incompatible with\n"
+      "                          '--prerecord'.\n"
+      "\n"
+      "  --transform-threads <n> Compute the per-cube transforms on the CPU\n"
+      "                          with up to <n> threads (default: 1).\n"
+      "\n"
+      "  --fixed-dt <ms>         Advance the animation by <ms> milliseconds per\n"
+      "                          frame instead of with real time, so every run\n"
+      "                          renders the same frames.\n"
+      "\n"
+      "  --startup-profile       Print how long each startup step took, up to\n"
+      "                          the first present.\n"
+      "\n"
+      "  --startup-output <file> Also write the startup profile to <file> as\n"
+      "                          JSON. Implies '--startup-profile'.\n"
       ;
 
    fprintf(f, "%s", usage);
@@ -918,6 +1489,51 @@ usage_error(const char *fmt, ...)
    exit(EXIT_FAILURE);
 }
 
+static uint32_t
+parse_uint(const char *arg, const char *name, uint32_t min, uint32_t max)
+{
+   char *end;
+   unsigned long n;
+
+   errno = 0;
+   n = strtoul(arg, &end, 10);
+   if (errno || end == arg || *end != '\0' || n < min || n > max)
+      usage_error("option %s takes a number between %u and %u", name, min, max);
+
+   return n;
+}
+
+/* A positive duration in milliseconds, returned in nanoseconds. */
+static uint64_t
+parse_ms(const char *arg, const char *name)
+{
+   char *end;
+   double ms;
+
+   errno = 0;
+   ms = strtod(arg, &end);
+   if (errno || end == arg || *end != '\0' || !(ms > 0.0) || ms > 1e6)
+      usage_error("option %s takes a duration in milliseconds, at most 1e6", name);
+
+   return (uint64_t) llround(ms * 1e6);
+}
+
+enum {
+   OPT_BENCH = 256,
+   OPT_BENCH_WARMUP,
+   OPT_BENCH_OUTPUT,
+   OPT_PRERECORD,
+   OPT_PUSH_CONSTANTS,
+   OPT_INTERLEAVED,
+   OPT_COMPACT_VERTICES,
+   OPT_GPU_CULL,
+   OPT_GPU_ANIMATE,
+   OPT_TRANSFORM_THREADS,
+   OPT_FIXED_DT,
+   OPT_STARTUP_PROFILE,
+   OPT_STARTUP_OUTPUT,
+};
+
 static void
 parse_args(int argc, char *argv[])
 {
@@ -929,14 +1545,37 @@ parse_args(int argc, char *argv[])
     * The initial ':' in the optstring makes getopt return ':' when an option
     * is missing a required argument.
     */
-   static const char *optstring = "+:m:k:";
+   static const char *optstring = "+:nm:k:f:o:c:";
+   static const struct option long_options[] = {
+      { "bench",             required_argument, NULL, OPT_BENCH },
+      { "bench-warmup",      required_argument, NULL, OPT_BENCH_WARMUP },
+      { "bench-output",      required_argument, NULL, OPT_BENCH_OUTPUT },
+      { "prerecord",         no_argument,       NULL, OPT_PRERECORD },
+      { "push-constants",    no_argument,       NULL, OPT_PUSH_CONSTANTS },
+      { "interleaved",       no_argument,       NULL, OPT_INTERLEAVED },
+      { "compact-vertices",  no_argument,       NULL, OPT_COMPACT_VERTICES },
+      { "gpu-cull",          no_argument,       NULL, OPT_GPU_CULL },
+      { "gpu-animate",       no_argument,       NULL, OPT_GPU_ANIMATE },
+      { "transform-threads", required_argument, NULL, OPT_TRANSFORM_THREADS },
+      { "fixed-dt",          required_argument, NULL, OPT_FIXED_DT },
+      { "startup-profile",   no_argument,       NULL, OPT_STARTUP_PROFILE },
+      { "startup-output",    required_argument, NULL, OPT_STARTUP_OUTPUT },
+      { 0 }
+   };
 
    int opt;
    bool found_arg_headless = false;
    bool found_arg_display_mode = false;
 
-   while ((opt = getopt(argc, argv, optstring)) != -1) {
+   while ((opt = getopt_long(argc, argv, optstring, long_options, NULL)) != -1) {
       switch (opt) {
+      case 'n':
+         found_arg_headless = true;
+         display_mode = DISPLAY_MODE_HEADLESS;
+         break;
+      case 'o':
+         output_file = optarg;
+         break;
       case 'm':
          found_arg_display_mode = true;
          if (!display_mode_from_string(optarg, &display_mode))
@@ -955,11 +1594,63 @@ parse_args(int argc, char *argv[])
          }
          break;
       }
+      case 'f':
+         frames_in_flight = parse_uint(optarg, "-f", 1, MAX_FRAMES_IN_FLIGHT);
+         break;
+      case 'c':
+         cube_count = parse_uint(optarg, "-c", 1, MAX_INSTANCES);
+         break;
+      case OPT_BENCH:
+         bench_frames = parse_uint(optarg, "--bench", 1, UINT32_MAX / 2);
+         break;
+      case OPT_BENCH_WARMUP:
+         bench_warmup = parse_uint(optarg, "--bench-warmup", 0, UINT32_MAX / 2);
+         break;
+      case OPT_BENCH_OUTPUT:
+         bench_output = optarg;
+         break;
+      case OPT_PRERECORD:
+         prerecord = true;
+         break;
+      case OPT_PUSH_CONSTANTS:
+         push_constants = true;
+         break;
+      case OPT_INTERLEAVED:
+         interleaved = true;
+         break;
+      case OPT_COMPACT_VERTICES:
+         compact_vertices = true;
+         break;
+      case OPT_GPU_CULL:
+         gpu_cull = true;
+         break;
+      case OPT_GPU_ANIMATE:
+         gpu_animate = true;
+         break;
+      case OPT_TRANSFORM_THREADS:
+         transform_threads = parse_uint(optarg, "--transform-threads", 1,
+                                        ES_BATCH_MAX_THREADS);
+         break;
+      case OPT_FIXED_DT:
+         fixed_dt_ns = parse_ms(optarg, "--fixed-dt");
+         break;
+      case OPT_STARTUP_PROFILE:
+         startup_profile = true;
+         break;
+      case OPT_STARTUP_OUTPUT:
+         startup_output = optarg;
+         break;
       case '?':
-         usage_error("invalid option '-%c'", optopt);
+         if (optopt)
+            usage_error("invalid option '-%c'", optopt);
+         else
+            usage_error("invalid option '%s'", argv[optind - 1]);
          break;
       case ':':
-         usage_error("option -%c requires an argument", optopt);
+         if (optopt < OPT_BENCH)
+            usage_error("option -%c requires an argument", optopt);
+         else
+            usage_error("option %s requires an argument", argv[optind - 1]);
          break;
       default:
          assert(!"unreachable");
@@ -970,6 +1661,13 @@ parse_args(int argc, char *argv[])
    if (found_arg_headless && found_arg_display_mode)
       usage_error("options -n and -m are mutually exclusive");
 
+   if (prerecord && push_constants)
+      usage_error("options --prerecord and --push-constants are mutually exclusive");
+   if (prerecord && gpu_cull)
+      usage_error("options --prerecord and --gpu-cull are mutually exclusive");
+   if (prerecord && gpu_animate)
+      usage_error("options --prerecord and --gpu-animate are mutually exclusive");
+
    if (optind != argc)
       usage_error("trailing args");
 }
@@ -982,9 +1680,16 @@ init_display(struct vkcube *vc)
          display_mode = DISPLAY_MODE_XCB;
          if (init_xcb(vc) == -1) {
             fprintf(stderr, "failed to initialize xcb, falling back "
-                            "to kms\n");
+                            "to headless\n");
+            display_mode = DISPLAY_MODE_HEADLESS;
+            if (init_headless(vc) == -1)
+               fail("failed to initialize headless mode");
          }
       break;
+   case DISPLAY_MODE_HEADLESS:
+      if (init_headless(vc) == -1)
+         fail("failed to initialize headless mode");
+      break;
    case DISPLAY_MODE_KHR:
       if (init_khr(vc) == -1)
          fail("fail to initialize khr");
@@ -1003,6 +1708,9 @@ mainloop(struct vkcube *vc)
    case DISPLAY_MODE_AUTO:
       assert(!"display mode is unset");
       break;
+   case DISPLAY_MODE_HEADLESS:
+      mainloop_headless(vc);
+      break;
    case DISPLAY_MODE_XCB:
       mainloop_xcb(vc);
       break;
@@ -1014,38 +1722,81 @@ mainloop(struct vkcube *vc)
 
 int main(int argc, char *argv[])
 {
-   int i;
-   struct vkcube vc;
+   struct vkcube vc = { 0 };
 
    parse_args(argc, argv);
+   startup_begin(&vc, startup_profile, startup_output);
 
    vc.model = cube_model;
+   vc.frames_in_flight = frames_in_flight;
+   vc.instance_count = cube_count;
+   vc.prerecord = prerecord;
+   vc.push_constants = push_constants;
+   vc.interleaved = interleaved;
+   vc.compact_vertices = compact_vertices;
+   vc.gpu_cull = gpu_cull;
+   vc.gpu_animate = gpu_animate;
+   esBatchSetThreads(transform_threads);
+   if (bench_frames > 0) {
+      vc.bench = bench_create(bench_warmup, bench_frames);
+      headless_frames = bench_warmup + bench_frames;
+   }
    vc.xcb.window = XCB_NONE;
    vc.width = 1280;
    vc.height = 720;
-   gettimeofday(&vc.start_tv, NULL);
+   frame_clock_init(&vc.clock, fixed_dt_ns);
 
    init_display(&vc);
    mainloop(&vc);
 
-   for(i = 0;i < vc.image_count;++i)
-      destroy_buffer(&vc, &vc.buffers[i]);
+   if (vc.bench) {
+      FILE *f = stdout;
+      if (bench_output) {
+         f = fopen(bench_output, "w");
+         fail_if(!f, "failed to open %s for writing", bench_output);
+      }
+      bench_report(&vc, f);
+      if (f != stdout)
+         fclose(f);
+   }
+
+   if (display_mode == DISPLAY_MODE_HEADLESS)
+      destroy_headless(&vc);
+   else if (vc.image_count > 0)
+      destroy_swapchain(&vc);
 
    vkDestroyDescriptorPool(vc.device, vc.desc_pool, NULL);
    vkDestroyBuffer(vc.device, vc.buffer, NULL);
+   vkDestroyBuffer(vc.device, vc.geometry_buffer, NULL);
+   vkDestroyBuffer(vc.device, vc.cull_buffer, NULL);
+   vkDestroyBuffer(vc.device, vc.animate_buffer, NULL);
+   vkDestroyBuffer(vc.device, vc.params_buffer, NULL);
    vkDestroySemaphore(vc.device, vc.semaphore, NULL);
    vkDestroyPipelineLayout(vc.device, vc.pipeline_layout, NULL);
    vkDestroyPipeline(vc.device, vc.pipeline, NULL);
+   vkDestroyPipelineLayout(vc.device, vc.cull_pipeline_layout, NULL);
+   vkDestroyPipeline(vc.device, vc.cull_pipeline, NULL);
+   vkDestroyPipelineLayout(vc.device, vc.animate_pipeline_layout, NULL);
+   vkDestroyPipeline(vc.device, vc.animate_pipeline, NULL);
+   pipelinecache_save(vc.device, vc.pipeline_cache, "vkcube");
+   vkDestroyPipelineCache(vc.device, vc.pipeline_cache, NULL);
    vkDestroyRenderPass(vc.device, vc.render_pass, NULL);
    vkDestroyCommandPool(vc.device, vc.cmd_pool, NULL);
    vkFreeMemory(vc.device, vc.mem, NULL);
-   vkDestroySwapchainKHR(vc.device, vc.swap_chain, NULL);
+   vkFreeMemory(vc.device, vc.geometry_mem, NULL);
+   vkFreeMemory(vc.device, vc.cull_mem, NULL);
+   vkFreeMemory(vc.device, vc.animate_mem, NULL);
+   vkFreeMemory(vc.device, vc.params_mem, NULL);
+   free(vc.instance_soa);
    vkDestroyDevice(vc.device, NULL);
 
    vkDestroySurfaceKHR(vc.instance, vc.surface, NULL);
    vkDestroyInstance(vc.instance, NULL);
-   xcb_destroy_window(vc.xcb.conn, vc.xcb.window);
-   xcb_disconnect(vc.xcb.conn);
+   bench_destroy(vc.bench);
+   if (vc.xcb.conn) {
+      xcb_destroy_window(vc.xcb.conn, vc.xcb.window);
+      xcb_disconnect(vc.xcb.conn);
+   }
 
    return 0;
 }
@@ -0,0 +1,233 @@
+#include <vulkan/vulkan.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "pipelinecache.h"
+
+#define PIPELINECACHE_DIR		"vkcube"
+#define PIPELINECACHE_HEADER_SIZE	(16 + VK_UUID_SIZE)
+
+
+static int pipelinecache_mkdirs(char* path)
+{
+	char*	p;
+
+	for(p = path + 1;*p;++p)
+	{
+		if(*p != '/')
+			continue;
+
+		*p = '\0';
+		if(mkdir(path, 0700) && errno != EEXIST)
+		{
+			*p = '/';
+			return -1;
+		}
+		*p = '/';
+	}
+
+	if(mkdir(path, 0700) && errno != EEXIST)
+		return -1;
+
+	return 0;
+}
+
+
+static int pipelinecache_path(char* path, size_t size, const char* name, int create_dir)
+{
+	const char*	xdg = getenv("XDG_CACHE_HOME");
+	const char*	home = getenv("HOME");
+	int		len;
+
+	/* XDG base directory spec: relative paths in XDG_CACHE_HOME are invalid */
+
+	if(xdg && xdg[0] == '/')
+		len = snprintf(path, size, "%s/%s", xdg, PIPELINECACHE_DIR);
+	else if(home && home[0])
+		len = snprintf(path, size, "%s/.cache/%s", home, PIPELINECACHE_DIR);
+	else
+		return -1;
+
+	if(len < 0 || len >= size)
+		return -1;
+
+	if(create_dir && pipelinecache_mkdirs(path))
+		return -1;
+
+	len = snprintf(path + len, size - len, "/%s.bin", name);
+
+	return len < 0 || len >= size ? -1 : 0;
+}
+
+
+static uint32_t pipelinecache_read_u32(const unsigned char* p)
+{
+	/* The header is stored least significant byte first on every platform */
+
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+
+/*
+ * Drivers are required to reject caches from other devices or driver
+ * versions, but not all of them do so gracefully, so check the header here.
+ */
+
+static int pipelinecache_validate(VkPhysicalDevice phydevice, const unsigned char* data, size_t size)
+{
+	VkPhysicalDeviceProperties	props;
+	uint32_t			header_size;
+
+	if(size < PIPELINECACHE_HEADER_SIZE)
+		return 0;
+
+	header_size = pipelinecache_read_u32(data);
+	if(header_size < PIPELINECACHE_HEADER_SIZE || header_size > size)
+		return 0;
+
+	vkGetPhysicalDeviceProperties(phydevice, &props);
+
+	return pipelinecache_read_u32(data + 4) == VK_PIPELINE_CACHE_HEADER_VERSION_ONE
+		&& pipelinecache_read_u32(data + 8) == props.vendorID
+		&& pipelinecache_read_u32(data + 12) == props.deviceID
+		&& !memcmp(data + 16, props.pipelineCacheUUID, VK_UUID_SIZE);
+}
+
+
+static unsigned char* pipelinecache_read_file(const char* path, size_t* size)
+{
+	FILE*		fp;
+	long		len;
+	unsigned char*	data = NULL;
+
+	fp = fopen(path, "rb");
+	if(!fp)
+		return NULL;
+
+	if(!fseek(fp, 0, SEEK_END) && (len = ftell(fp)) > 0 && !fseek(fp, 0, SEEK_SET))
+	{
+		data = malloc(len);
+		if(data && fread(data, 1, len, fp) == len)
+		{
+			*size = len;
+		}
+		else
+		{
+			free(data);
+			data = NULL;
+		}
+	}
+
+	fclose(fp);
+
+	return data;
+}
+
+
+VkPipelineCache pipelinecache_load(VkPhysicalDevice phydevice, VkDevice device, const char* name)
+{
+	char		path[4096];
+	unsigned char*	data = NULL;
+	size_t		size = 0;
+	VkPipelineCache	cache = VK_NULL_HANDLE;
+
+	if(!pipelinecache_path(path, sizeof(path), name, 0))
+		data = pipelinecache_read_file(path, &size);
+
+	if(data && !pipelinecache_validate(phydevice, data, size))
+	{
+		fprintf(stderr, "%s: pipeline cache is for another device or driver, ignoring\n", path);
+		free(data);
+		data = NULL;
+		size = 0;
+	}
+
+	if(data)
+	{
+		vkCreatePipelineCache
+		(
+			device,
+			&(VkPipelineCacheCreateInfo)
+			{
+				.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+				.initialDataSize = size,
+				.pInitialData = data,
+			},
+			NULL, &cache
+		);
+		free(data);
+	}
+
+	if(cache == VK_NULL_HANDLE)
+	{
+		vkCreatePipelineCache
+		(
+			device,
+			&(VkPipelineCacheCreateInfo)
+			{
+				.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+			},
+			NULL, &cache
+		);
+	}
+
+	return cache;
+}
+
+
+/*
+ * The cache is written to a temporary file next to the real one and renamed
+ * over it, so a crash or a concurrent instance never leaves a torn file.
+ */
+
+void pipelinecache_save(VkDevice device, VkPipelineCache cache, const char* name)
+{
+	char		path[4096];
+	char		tmp[4096 + 32];
+	void*		data;
+	size_t		size = 0;
+	FILE*		fp;
+	int		ok;
+
+	if(cache == VK_NULL_HANDLE)
+		return;
+
+	if(vkGetPipelineCacheData(device, cache, &size, NULL) != VK_SUCCESS || size == 0)
+		return;
+
+	data = malloc(size);
+	if(!data)
+		return;
+
+	if(vkGetPipelineCacheData(device, cache, &size, data) != VK_SUCCESS
+		|| pipelinecache_path(path, sizeof(path), name, 1))
+	{
+		free(data);
+		return;
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+
+	fp = fopen(tmp, "wb");
+	if(!fp)
+	{
+		fprintf(stderr, "%s: %s\n", tmp, strerror(errno));
+		free(data);
+		return;
+	}
+
+	ok = fwrite(data, 1, size, fp) == size && !fflush(fp) && !fsync(fileno(fp));
+	ok = !fclose(fp) && ok;
+
+	if(!ok || rename(tmp, path))
+	{
+		fprintf(stderr, "%s: failed to write pipeline cache: %s\n", path, strerror(errno));
+		unlink(tmp);
+	}
+
+	free(data);
+}
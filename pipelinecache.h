@@ -0,0 +1,24 @@
+#ifndef	__PIPELINECACHE_H__
+#define	__PIPELINECACHE_H__
+
+#include <vulkan/vulkan.h>
+
+#ifdef	__c_plusplus
+extern "C"
+{
+#endif
+
+/*
+ * On-disk VkPipelineCache kept in $XDG_CACHE_HOME/vkcube/<name>.bin
+ * ($HOME/.cache when XDG_CACHE_HOME is unset). A missing, truncated or
+ * foreign cache file is ignored and an empty cache is created instead.
+ */
+
+VkPipelineCache	pipelinecache_load	(VkPhysicalDevice phydevice, VkDevice device, const char* name);
+void		pipelinecache_save	(VkDevice device, VkPipelineCache cache, const char* name);
+
+#ifdef	__c_plusplus
+}
+#endif
+
+#endif	/* __PIPELINECACHE_H__ */
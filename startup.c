@@ -0,0 +1,76 @@
+/* Startup profiling for --startup-profile. Each startup_mark() charges the
+ * time since the previous mark to the named phase; startup_finish() closes
+ * the last phase once the first frame reaches the screen (or, headless, the
+ * queue) and reports the breakdown. Phases may repeat, e.g. when the
+ * swapchain is recreated before the first present.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "common.h"
+
+void
+startup_begin(struct vkcube *vc, bool enabled, const char *json_path)
+{
+   struct startup *s = &vc->startup;
+
+   s->enabled = enabled || json_path;
+   s->json_path = json_path;
+   s->start_ns = bench_now();
+   s->last_ns = s->start_ns;
+}
+
+void
+startup_mark(struct vkcube *vc, const char *phase)
+{
+   struct startup *s = &vc->startup;
+
+   if (!s->enabled || s->done || s->count >= STARTUP_MAX_PHASES)
+      return;
+
+   uint64_t now = bench_now();
+   s->phases[s->count].name = phase;
+   s->phases[s->count].ns = now - s->last_ns;
+   s->count++;
+   s->last_ns = now;
+}
+
+static void
+startup_report_json(struct startup *s, FILE *f)
+{
+   fprintf(f, "{\n");
+   fprintf(f, "  \"phases\": [\n");
+   for (uint32_t i = 0; i < s->count; i++)
+      fprintf(f, "    { \"phase\": \"%s\", \"ms\": %.4f }%s\n",
+              s->phases[i].name, s->phases[i].ns / 1e6,
+              i + 1 < s->count ? "," : "");
+   fprintf(f, "  ],\n");
+   fprintf(f, "  \"total_ms\": %.4f\n", (s->last_ns - s->start_ns) / 1e6);
+   fprintf(f, "}\n");
+}
+
+void
+startup_finish(struct vkcube *vc, const char *phase)
+{
+   struct startup *s = &vc->startup;
+
+   if (!s->enabled || s->done)
+      return;
+
+   startup_mark(vc, phase);
+   s->done = true;
+
+   for (uint32_t i = 0; i < s->count; i++)
+      fprintf(stderr, "startup: %-16s %9.3f ms\n",
+              s->phases[i].name, s->phases[i].ns / 1e6);
+   fprintf(stderr, "startup: %-16s %9.3f ms\n", "total",
+           (s->last_ns - s->start_ns) / 1e6);
+
+   if (s->json_path) {
+      FILE *f = fopen(s->json_path, "w");
+      fail_if(!f, "failed to open %s for writing", s->json_path);
+      startup_report_json(s, f);
+      fclose(f);
+   }
+}
@@ -1,26 +1,52 @@
 #version 420 core
 
+#ifdef PUSH_CONSTANTS
+/* Fits in the 128 bytes every implementation must support. The columns of
+ * the normal matrix carry the modelview translation in w, which is enough to
+ * rebuild the (affine) modelview matrix. */
+layout(push_constant) uniform block {
+    mat4 modelviewprojectionMatrix;
+    vec4 normalColumns[3];
+};
+#else
 layout(std140, set = 0, binding = 0) uniform block {
     uniform mat4 modelviewMatrix;
     uniform mat4 modelviewprojectionMatrix;
     uniform mat3 normalMatrix;
 };
+#endif
 
 layout(location = 0) in vec4 in_position;
 layout(location = 1) in vec4 in_color;
 layout(location = 2) in vec3 in_normal;
 
+/* Per instance */
+layout(location = 3) in mat4 in_model;
+layout(location = 7) in vec4 in_instance_color;
+
 vec4 lightSource = vec4(2.0, 2.0, 20.0, 0.0);
 
 layout(location = 0) out vec4 vVaryingColor;
 
 void main()
 {
-    gl_Position = modelviewprojectionMatrix * in_position;
-    vec3 vEyeNormal = normalMatrix * in_normal;
-    vec4 vPosition4 = modelviewMatrix * in_position;
+#ifdef PUSH_CONSTANTS
+    mat3 normalMatrix = mat3(normalColumns[0].xyz,
+                             normalColumns[1].xyz,
+                             normalColumns[2].xyz);
+    mat4 modelviewMatrix = mat4(vec4(normalColumns[0].xyz, 0.0),
+                                vec4(normalColumns[1].xyz, 0.0),
+                                vec4(normalColumns[2].xyz, 0.0),
+                                vec4(normalColumns[0].w,
+                                     normalColumns[1].w,
+                                     normalColumns[2].w, 1.0));
+#endif
+    vec4 position = in_model * in_position;
+    gl_Position = modelviewprojectionMatrix * position;
+    vec3 vEyeNormal = normalize(normalMatrix * (mat3(in_model) * in_normal));
+    vec4 vPosition4 = modelviewMatrix * position;
     vec3 vPosition3 = vPosition4.xyz / vPosition4.w;
     vec3 vLightDir = normalize(lightSource.xyz - vPosition3);
     float diff = max(0.0, dot(vEyeNormal, vLightDir));
-    vVaryingColor = vec4(diff * in_color.rgb, 1.0);
+    vVaryingColor = vec4(diff * in_color.rgb * in_instance_color.rgb, 1.0);
 }
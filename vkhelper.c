@@ -2,9 +2,26 @@
 #include <vulkan/vulkan.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include <X11/Xlib.h>
 
 #include "vkhelper.h"
+#include "pipelinecache.h"
+
+#define VKHELPER_PIPELINE_CACHE_NAME	"vkhelper"
+
+/* Buffers and images are suballocated from blocks of this size; anything
+ * larger than half a block gets a block of its own. */
+#define VKHELPER_MEMORY_BLOCK_SIZE	(16 * 1024 * 1024)
+
+/* Uploads are staged in a ring of this size, grown to fit the largest single
+ * upload, and up to VKHELPER_MAX_UPLOADS of them can be in flight. */
+#define VKHELPER_STAGING_SIZE		(4 * 1024 * 1024)
+#define VKHELPER_STAGING_ALIGNMENT	16
+#define VKHELPER_MAX_UPLOADS		16
+
+#define VKHELPER_IMAGE_FORMAT		VK_FORMAT_B8G8R8A8_UNORM
+#define VKHELPER_MIPMAP_GROUP_SIZE	8	/* local_size of mipmap.comp */
 
 struct vkhelper_swapsurface
 {
@@ -25,32 +42,162 @@ struct vkhelper_swapchain
 	VkSemaphore			semaphore;
 };
 
+struct vkhelper_memory_range
+{
+	VkDeviceSize			offset;
+	VkDeviceSize			size;
+	struct vkhelper_memory_range*	next;
+};
+
+/* Images and buffers never share a block, so a linear and an optimal
+ * resource can never sit within bufferImageGranularity of each other. */
+struct vkhelper_memory_block
+{
+	VkDeviceMemory			memory;
+	uint32_t			memtype;
+	int				is_image;
+	int				dedicated;
+	VkDeviceSize			size;
+	VkDeviceSize			used;
+	int				nr_allocations;
+	void*				mapped;
+	struct vkhelper_memory_range*	free;	/* sorted by offset, neighbours merged */
+	struct vkhelper_memory_block*	next;
+};
+
+struct vkhelper_memory
+{
+	struct vkhelper_memory_block*	block;
+	VkDeviceSize			offset;
+	VkDeviceSize			size;
+};
+
+/* Queue family ownership acquires, recorded on the graphics queue by
+ * vkhelper_cmd_acquire_uploads() */
+struct vkhelper_barriers
+{
+	VkPipelineStageFlags	stages;
+	uint32_t		nr_buffers;
+	uint32_t		max_buffers;
+	VkBufferMemoryBarrier*	buffers;
+	uint32_t		nr_images;
+	uint32_t		max_images;
+	VkImageMemoryBarrier*	images;
+};
+
+/* Images whose mip chain is generated once level 0 is uploaded */
+struct vkhelper_mipmaps
+{
+	uint32_t		nr_images;
+	uint32_t		max_images;
+	struct vkhelper_image**	images;
+};
+
+struct vkhelper_upload_copy
+{
+	VkBuffer		buffer;		/* destination, or VK_NULL_HANDLE */
+	VkImage			image;
+	VkBufferCopy		buffer_region;
+	VkBufferImageCopy	image_region;
+};
+
+/* An upload, or a batch of them, is gathered here and recorded when it is
+ * flushed: one barrier for all of pre, the copies, one barrier for post */
+struct vkhelper_upload
+{
+	VkCommandBuffer		cmdbuf;
+	VkFence			fence;
+	VkDeviceSize		staging_start;
+	VkDeviceSize		staging_end;	/* staging_head once this upload was reserved */
+	uint64_t		token;
+	uint32_t		nr_copies;
+	uint32_t		max_copies;
+	struct vkhelper_upload_copy*	copies;
+	struct vkhelper_barriers	pre;
+	struct vkhelper_barriers	post;
+	struct vkhelper_barriers	acquire;
+	struct vkhelper_mipmaps		mipmaps;
+};
+
 struct vkhelper_device
 {
 	VkInstance		instance;
 	VkPhysicalDevice	phydevice;
 	int			queuefamily;
+	VkQueueFlags		queueflags;
 	VkDevice		device;
 	VkQueue			queue;
+	int			transferfamily;
+	VkQueue			transferqueue;
 	VkSurfaceKHR		surface;
 	VkCommandPool		cmdpool;
 	VkCommandBuffer		cmdbuf;
+	VkPipelineCache		pipelinecache;
 
 	struct vkhelper_swapchain*	swapchain;
 
+	VkPhysicalDeviceMemoryProperties	memprop;
+	struct vkhelper_memory_block*		blocks;
+
+	/* Staging ring. head and tail count every byte ever reserved and
+	 * retired, so head - tail is the part the GPU may still read. */
+	VkCommandPool			uploadpool;
+	struct vkhelper_buffer*		staging;
+	char*				staging_map;
+	VkDeviceSize			staging_size;
+	VkDeviceSize			staging_head;
+	VkDeviceSize			staging_tail;
+	struct vkhelper_upload		uploads[VKHELPER_MAX_UPLOADS];	/* in flight, oldest first */
+	struct vkhelper_upload*		recording;
+	int				batch;
+	uint64_t			upload_token;	/* last one submitted */
+
+	/* With a transfer queue family of its own, the worker submits uploads
+	 * to transferqueue and retires them. lock guards everything below
+	 * and staging_tail. */
+	pthread_t			worker;
+	int				worker_running;
+	int				worker_quit;
+	pthread_mutex_t			lock;
+	pthread_cond_t			upload_queued;
+	pthread_cond_t			upload_retired;
+	int				upload_first;
+	int				nr_uploads;
+	int				nr_submitted;
+	uint64_t			completed_token;
+	uint64_t			acquired_token;
+	struct vkhelper_barriers	acquire;
+	struct vkhelper_mipmaps		mipmaps;
+
+	/* Compute mip generation, for formats that cannot be blitted */
+	VkDescriptorSetLayout		mipsetlayout;
+	VkPipelineLayout		miplayout;
+	VkPipeline			mippipeline;
 };
 
 struct vkhelper_buffer
 {
-	VkBuffer	buffer;
-	VkDeviceMemory	memory;
+	VkBuffer		buffer;
+	struct vkhelper_memory	memory;
+	uint64_t		upload;
 };
 
 struct vkhelper_image
 {
-	VkImage		image;
-	VkDeviceMemory	memory;
-	VkImageView	view;
+	VkImage			image;
+	struct vkhelper_memory	memory;
+	VkImageView		view;
+	uint64_t		upload;
+	int			width;
+	int			height;
+	uint32_t		levels;
+
+	/* Set when the mip chain is made by mipmap.comp: level_sets[i] reads
+	 * level_views[i] and writes level_views[i + 1] */
+	int			compute;
+	VkImageView*		level_views;
+	VkDescriptorPool	level_pool;
+	VkDescriptorSet*	level_sets;
 };
 
 struct vkhelper_renderpass
@@ -62,6 +209,16 @@ struct vkhelper_renderpass
 };
 
 
+extern unsigned char mipmap_comp_spv[];
+extern unsigned int mipmap_comp_spv_len;
+
+
+static void vkhelper_memory_block_destroy(struct vkhelper_device* device, struct vkhelper_memory_block* block);
+static void vkhelper_upload_init(struct vkhelper_device* device);
+static void vkhelper_upload_fini(struct vkhelper_device* device);
+static void vkhelper_barriers_remove_buffer(struct vkhelper_barriers* barriers, VkBuffer buffer);
+
+
 struct vkhelper_device* vkhelper_device_create_with_xlib(Display* display, Window window)
 {
 	const char* const extensions_for_instance[] =
@@ -118,6 +275,19 @@ struct vkhelper_device* vkhelper_device_create_with_xlib(Display* display, Windo
 		if(queuefamilyprops[i].queueFlags & VK_QUEUE_GRAPHICS_BIT)
 		{
 			device->queuefamily = i;
+			device->queueflags = queuefamilyprops[i].queueFlags;
+			break;
+		}
+	}
+
+	/* A transfer-only family is usually a copy engine that runs next to
+	 * the graphics queue */
+	device->transferfamily = device->queuefamily;
+	for(i = 0;i < nr_queuefamily;++i)
+	{
+		if((queuefamilyprops[i].queueFlags & (VK_QUEUE_TRANSFER_BIT | VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT)) == VK_QUEUE_TRANSFER_BIT)
+		{
+			device->transferfamily = i;
 			break;
 		}
 	}
@@ -125,7 +295,7 @@ struct vkhelper_device* vkhelper_device_create_with_xlib(Display* display, Windo
 	free(queuefamilyprops);
 
 
-	/* Create device and get command queue */
+	/* Create device and get command queues */
 
 	vkCreateDevice
 	(
@@ -133,13 +303,22 @@ struct vkhelper_device* vkhelper_device_create_with_xlib(Display* display, Windo
 		&(VkDeviceCreateInfo)
 		{
 			.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
-			.pQueueCreateInfos = &(VkDeviceQueueCreateInfo)
+			.pQueueCreateInfos = (VkDeviceQueueCreateInfo[2])
 			{
-				.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
-				.queueCount = 1,
-				.queueFamilyIndex = device->queuefamily,
+				{
+					.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+					.queueCount = 1,
+					.queueFamilyIndex = device->queuefamily,
+					.pQueuePriorities = &(float) { 1.0f },
+				},
+				{
+					.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+					.queueCount = 1,
+					.queueFamilyIndex = device->transferfamily,
+					.pQueuePriorities = &(float) { 1.0f },
+				},
 			},
-			.queueCreateInfoCount = 1,
+			.queueCreateInfoCount = device->transferfamily != device->queuefamily ? 2 : 1,
 			.ppEnabledExtensionNames = &(const char*)
 			{
 				VK_KHR_SWAPCHAIN_EXTENSION_NAME,
@@ -150,6 +329,7 @@ struct vkhelper_device* vkhelper_device_create_with_xlib(Display* display, Windo
 	);
 
 	vkGetDeviceQueue(device->device, device->queuefamily, 0, &device->queue);
+	vkGetDeviceQueue(device->device, device->transferfamily, 0, &device->transferqueue);
 
 
 	/* Create Xlib surface */
@@ -196,6 +376,11 @@ struct vkhelper_device* vkhelper_device_create_with_xlib(Display* display, Windo
 		&device->cmdbuf
 	);
 
+	device->pipelinecache = pipelinecache_load(device->phydevice, device->device, VKHELPER_PIPELINE_CACHE_NAME);
+
+	vkGetPhysicalDeviceMemoryProperties(device->phydevice, &device->memprop);
+	vkhelper_upload_init(device);
+
 	return device;
 }
 
@@ -204,6 +389,9 @@ struct vkhelper_device* vkhelper_device_create_with_vkdevice(VkPhysicalDevice ph
 {
 	struct vkhelper_device* device = NULL;
 
+	uint32_t			nr_queuefamily;
+	VkQueueFamilyProperties*	queuefamilyprops;
+
 	device = calloc(1, sizeof(struct vkhelper_device));
 
 	device->device = vkdevice;
@@ -211,6 +399,16 @@ struct vkhelper_device* vkhelper_device_create_with_vkdevice(VkPhysicalDevice ph
 	device->queuefamily = queuefamily;
 	vkGetDeviceQueue(device->device, device->queuefamily, 0, &device->queue);
 
+	/* Only the queues of queuefamily are known to exist */
+	device->transferfamily = queuefamily;
+	device->transferqueue = device->queue;
+
+	vkGetPhysicalDeviceQueueFamilyProperties(device->phydevice, &nr_queuefamily, NULL);
+	queuefamilyprops = calloc(nr_queuefamily, sizeof(VkQueueFamilyProperties));
+	vkGetPhysicalDeviceQueueFamilyProperties(device->phydevice, &nr_queuefamily, queuefamilyprops);
+	device->queueflags = queuefamilyprops[queuefamily].queueFlags;
+	free(queuefamilyprops);
+
 	/* Create command pool */
 
 	vkCreateCommandPool
@@ -240,13 +438,26 @@ struct vkhelper_device* vkhelper_device_create_with_vkdevice(VkPhysicalDevice ph
 		&device->cmdbuf
 	);
 
+	device->pipelinecache = pipelinecache_load(device->phydevice, device->device, VKHELPER_PIPELINE_CACHE_NAME);
+
+	vkGetPhysicalDeviceMemoryProperties(device->phydevice, &device->memprop);
+	vkhelper_upload_init(device);
+
 	return device;
 }
 
 
 void vkhelper_device_destroy(struct vkhelper_device* device)
 {
+	struct vkhelper_memory_block* block;
+
+	pipelinecache_save(device->device, device->pipelinecache, VKHELPER_PIPELINE_CACHE_NAME);
+	vkDestroyPipelineCache(device->device, device->pipelinecache, NULL);
 	vkDestroyCommandPool(device->device, device->cmdpool, NULL);
+	vkhelper_upload_fini(device);
+
+	while((block = device->blocks))
+		vkhelper_memory_block_destroy(device, block);
 
 	if(device->instance)
 	{
@@ -456,15 +667,8 @@ struct vkhelper_swapchain* vkhelper_swapchain_create_with_vkswapchain(struct vkh
 
 	free(images);
 
-	vkCreateSemaphore
-	(
-		device->device,
-		&(VkSemaphoreCreateInfo)
-		{
-			.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
-		},
-		NULL, &swapchain->semaphore
-	);
+	/* The acquire semaphore belongs to the application and is handed in with
+	 * vkhelper_swapchain_set_semaphore() on every acquire. */
 
 	return swapchain;
 }
@@ -472,7 +676,8 @@ struct vkhelper_swapchain* vkhelper_swapchain_create_with_vkswapchain(struct vkh
 
 void vkhelper_swapchain_set_semaphore(struct vkhelper_device* device, struct vkhelper_swapchain* swapchain, VkSemaphore semaphore)
 {
-	if(swapchain->semaphore && swapchain->semaphore != semaphore)
+	/* Only a swapchain created by vkhelper owns its semaphore */
+	if(!swapchain->info.sType && swapchain->semaphore && swapchain->semaphore != semaphore)
 		vkDestroySemaphore(device->device, swapchain->semaphore, NULL);
 	swapchain->semaphore = semaphore;
 }
@@ -597,15 +802,177 @@ VkShaderModule vkhelper_shadermodule_create(struct vkhelper_device* device, cons
 }
 
 
-static VkDeviceMemory vkhelper_memory_allocate(struct vkhelper_device* device, int is_image, void* object, VkMemoryPropertyFlags flags)
+static int vkhelper_memory_find_type(struct vkhelper_device* device, uint32_t typebits, VkMemoryPropertyFlags flags)
+{
+	int i;
+
+	for(i = 0;i < device->memprop.memoryTypeCount;i++)
+	{
+		if(typebits & (1 << i) && (device->memprop.memoryTypes[i].propertyFlags & flags) == flags)
+			return i;
+	}
+
+	return -1;
+}
+
+
+static struct vkhelper_memory_block* vkhelper_memory_block_create(struct vkhelper_device* device, uint32_t memtype, int is_image, VkDeviceSize size, int dedicated)
+{
+	struct vkhelper_memory_block* block = NULL;
+
+	block = calloc(1, sizeof(struct vkhelper_memory_block));
+
+	if
+	(
+		vkAllocateMemory
+		(
+			device->device,
+			&(VkMemoryAllocateInfo)
+			{
+				.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+				.allocationSize = size,
+				.memoryTypeIndex = memtype,
+			},
+			NULL, &block->memory
+		) != VK_SUCCESS
+	)
+	{
+		free(block);
+		return NULL;
+	}
+
+	/* Host visible blocks stay mapped: a VkDeviceMemory can only be mapped
+	 * once at a time, and several buffers may live in it. */
+	if(device->memprop.memoryTypes[memtype].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+		vkMapMemory(device->device, block->memory, 0, VK_WHOLE_SIZE, 0, &block->mapped);
+
+	block->memtype = memtype;
+	block->is_image = is_image;
+	block->dedicated = dedicated;
+	block->size = size;
+	block->free = calloc(1, sizeof(struct vkhelper_memory_range));
+	block->free->size = size;
+
+	block->next = device->blocks;
+	device->blocks = block;
+
+	return block;
+}
+
+
+static void vkhelper_memory_block_destroy(struct vkhelper_device* device, struct vkhelper_memory_block* block)
+{
+	struct vkhelper_memory_block** link;
+	struct vkhelper_memory_range* range;
+
+	for(link = &device->blocks;*link != block;link = &(*link)->next)
+		;
+	*link = block->next;
+
+	while((range = block->free))
+	{
+		block->free = range->next;
+		free(range);
+	}
+
+	if(block->mapped)
+		vkUnmapMemory(device->device, block->memory);
+	vkFreeMemory(device->device, block->memory, NULL);
+	free(block);
+}
+
+
+/* First fit. The padding in front of an aligned offset stays on the free
+ * list, so small alignments do not leak space. */
+static int vkhelper_memory_block_alloc(struct vkhelper_memory_block* block, VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize* offset)
+{
+	struct vkhelper_memory_range** link;
+	struct vkhelper_memory_range* range;
+	struct vkhelper_memory_range* tail;
+	VkDeviceSize start, end;
+
+	for(link = &block->free;(range = *link);link = &range->next)
+	{
+		start = (range->offset + alignment - 1) / alignment * alignment;
+		end = range->offset + range->size;
+
+		if(start + size > end)
+			continue;
+
+		if(start + size < end)
+		{
+			tail = calloc(1, sizeof(struct vkhelper_memory_range));
+			tail->offset = start + size;
+			tail->size = end - tail->offset;
+			tail->next = range->next;
+			range->next = tail;
+		}
+
+		if(start > range->offset)
+		{
+			range->size = start - range->offset;
+		}
+		else
+		{
+			*link = range->next;
+			free(range);
+		}
+
+		block->used += size;
+		block->nr_allocations++;
+		*offset = start;
+		return 1;
+	}
+
+	return 0;
+}
+
+
+static void vkhelper_memory_block_release(struct vkhelper_memory_block* block, VkDeviceSize offset, VkDeviceSize size)
+{
+	struct vkhelper_memory_range** link;
+	struct vkhelper_memory_range* prev = NULL;
+	struct vkhelper_memory_range* next;
+	struct vkhelper_memory_range* range;
+
+	for(link = &block->free;(next = *link) && next->offset < offset;link = &next->next)
+		prev = next;
+
+	if(prev && prev->offset + prev->size == offset)
+	{
+		range = prev;
+		range->size += size;
+	}
+	else
+	{
+		range = calloc(1, sizeof(struct vkhelper_memory_range));
+		range->offset = offset;
+		range->size = size;
+		range->next = next;
+		*link = range;
+	}
+
+	if(next && range->offset + range->size == next->offset)
+	{
+		range->size += next->size;
+		range->next = next->next;
+		free(next);
+	}
+
+	block->used -= size;
+	block->nr_allocations--;
+}
+
+
+static struct vkhelper_memory vkhelper_memory_allocate(struct vkhelper_device* device, int is_image, void* object, VkMemoryPropertyFlags flags)
 {
-	int i, memtype;
+	int memtype;
 	VkImage		image;
 	VkBuffer	buffer;
-	VkDeviceMemory	memory;
+	VkDeviceSize	offset = 0;
 
-	VkMemoryRequirements			memreq;
-	VkPhysicalDeviceMemoryProperties	memprop;
+	VkMemoryRequirements		memreq;
+	struct vkhelper_memory_block*	block;
 
 	image = is_image ? object : NULL;
 	buffer = is_image ? NULL : object;
@@ -615,35 +982,92 @@ static VkDeviceMemory vkhelper_memory_allocate(struct vkhelper_device* device, i
 	else
 		vkGetBufferMemoryRequirements(device->device, buffer, &memreq);
 
-	vkGetPhysicalDeviceMemoryProperties(device->phydevice, &memprop);
+	memtype = vkhelper_memory_find_type(device, memreq.memoryTypeBits, flags);
+	if(memtype < 0)
+		return (struct vkhelper_memory) { 0 };
 
-	for(i = 0;i < memprop.memoryTypeCount;i++)
+	for(block = device->blocks;block;block = block->next)
 	{
-		if(memreq.memoryTypeBits & (1 << i) && (memprop.memoryTypes[i].propertyFlags & flags) == flags)
-		{
-			memtype = i;
+		if(block->memtype != memtype || block->is_image != is_image || block->dedicated)
+			continue;
+		if(vkhelper_memory_block_alloc(block, memreq.size, memreq.alignment, &offset))
 			break;
-		}
 	}
 
-	vkAllocateMemory
-	(
-		device->device,
-		&(VkMemoryAllocateInfo)
-		{
-			.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-			.allocationSize = memreq.size,
-			.memoryTypeIndex = memtype,
-		},
-		NULL, &memory
-	);
+	if(!block)
+	{
+		if(memreq.size > VKHELPER_MEMORY_BLOCK_SIZE / 2)
+			block = vkhelper_memory_block_create(device, memtype, is_image, memreq.size, True);
+		else
+			block = vkhelper_memory_block_create(device, memtype, is_image, VKHELPER_MEMORY_BLOCK_SIZE, False);
+
+		if(!block)
+			return (struct vkhelper_memory) { 0 };
+
+		vkhelper_memory_block_alloc(block, memreq.size, memreq.alignment, &offset);
+	}
 
 	if(is_image)
-		vkBindImageMemory(device->device, image, memory, 0);
+		vkBindImageMemory(device->device, image, block->memory, offset);
 	else
-		vkBindBufferMemory(device->device, buffer, memory, 0);
+		vkBindBufferMemory(device->device, buffer, block->memory, offset);
+
+	return (struct vkhelper_memory)
+	{
+		.block = block,
+		.offset = offset,
+		.size = memreq.size,
+	};
+}
+
+
+/* Empty shared blocks are kept for the next allocation, so freeing and
+ * creating buffers does not mean a vkAllocateMemory each time. */
+static void vkhelper_memory_free(struct vkhelper_device* device, struct vkhelper_memory* memory)
+{
+	struct vkhelper_memory_block* block = memory->block;
+
+	if(!block)
+		return;
+
+	vkhelper_memory_block_release(block, memory->offset, memory->size);
+	if(block->dedicated && !block->nr_allocations)
+		vkhelper_memory_block_destroy(device, block);
+
+	memory->block = NULL;
+}
 
-	return memory;
+
+static void* vkhelper_memory_map(struct vkhelper_memory* memory)
+{
+	return (char*)memory->block->mapped + memory->offset;
+}
+
+
+void vkhelper_device_get_memory_stats(struct vkhelper_device* device, struct vkhelper_memory_stats* stats)
+{
+	struct vkhelper_memory_block* block;
+	struct vkhelper_memory_range* range;
+
+	memset(stats, 0, sizeof(struct vkhelper_memory_stats));
+
+	for(block = device->blocks;block;block = block->next)
+	{
+		stats->nr_blocks++;
+		stats->nr_allocations += block->nr_allocations;
+		stats->bytes_reserved += block->size;
+		stats->bytes_used += block->used;
+
+		for(range = block->free;range;range = range->next)
+		{
+			stats->bytes_free += range->size;
+			if(range->size > stats->largest_free)
+				stats->largest_free = range->size;
+		}
+	}
+
+	if(stats->bytes_free)
+		stats->fragmentation = 1.0f - (float)stats->largest_free / stats->bytes_free;
 }
 
 
@@ -691,8 +1115,16 @@ struct vkhelper_buffer* vkhelper_buffer_create(struct vkhelper_device* device, e
 
 void vkhelper_buffer_destroy(struct vkhelper_device* device, struct vkhelper_buffer* buffer)
 {
-	vkFreeMemory(device->device, buffer->memory, NULL);
+	/* As for images, the upload may still be recording or in flight, or
+	 * have its acquire waiting for vkhelper_cmd_acquire_uploads() */
+	vkhelper_upload_wait(device, buffer->upload);
+
+	pthread_mutex_lock(&device->lock);
+	vkhelper_barriers_remove_buffer(&device->acquire, buffer->buffer);
+	pthread_mutex_unlock(&device->lock);
+
 	vkDestroyBuffer(device->device, buffer->buffer, NULL);
+	vkhelper_memory_free(device, &buffer->memory);
 	free(buffer);
 }
 
@@ -703,154 +1135,1132 @@ VkBuffer vkhelper_buffer_get_vkbuffer(struct vkhelper_buffer* buffer)
 }
 
 
-struct vkhelper_buffer* vkhelper_vertex_buffer_create(struct vkhelper_device* device, void* data, size_t size)
+vkhelper_upload_token vkhelper_buffer_get_upload_token(struct vkhelper_buffer* buffer)
 {
-	struct vkhelper_buffer* staging = NULL;
-	struct vkhelper_buffer* buffer = NULL;
-	void* ptr = NULL;
+	return buffer->upload;
+}
 
-	staging = vkhelper_buffer_create(device, VKHELPER_BUFFER_USAGE_STAGING, size);
 
-	vkMapMemory(device->device, staging->memory, 0, size, 0, &ptr);
-	memcpy(ptr, data, size);
-	vkUnmapMemory(device->device, staging->memory);
+static void vkhelper_barriers_add_buffer(struct vkhelper_barriers* barriers, VkPipelineStageFlags stage, const VkBufferMemoryBarrier* barrier)
+{
+	if(barriers->nr_buffers == barriers->max_buffers)
+	{
+		barriers->max_buffers = barriers->max_buffers ? barriers->max_buffers * 2 : 8;
+		barriers->buffers = realloc(barriers->buffers, barriers->max_buffers * sizeof(VkBufferMemoryBarrier));
+	}
 
-	buffer = vkhelper_buffer_create(device, VKHELPER_BUFFER_USAGE_VERTEX, size);
+	barriers->buffers[barriers->nr_buffers++] = *barrier;
+	barriers->stages |= stage;
+}
 
-	vkhelper_begin_cmdbuf(device);
-	vkCmdCopyBuffer
-	(
-		device->cmdbuf, staging->buffer, buffer->buffer, 1,
-		&(VkBufferCopy)
-		{
-			.size = size,
-		}
-	);
-	vkhelper_end_cmdbuf(device);
 
-	vkQueueSubmit
-	(
-		device->queue, 1,
-		&(VkSubmitInfo)
-		{
-			.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-			.pCommandBuffers = &device->cmdbuf,
-			.commandBufferCount = 1,
-		},
-		VK_NULL_HANDLE
-	);
+static void vkhelper_barriers_add_image(struct vkhelper_barriers* barriers, VkPipelineStageFlags stage, const VkImageMemoryBarrier* barrier)
+{
+	if(barriers->nr_images == barriers->max_images)
+	{
+		barriers->max_images = barriers->max_images ? barriers->max_images * 2 : 8;
+		barriers->images = realloc(barriers->images, barriers->max_images * sizeof(VkImageMemoryBarrier));
+	}
 
-	vkQueueWaitIdle(device->queue);
+	barriers->images[barriers->nr_images++] = *barrier;
+	barriers->stages |= stage;
+}
 
-	vkhelper_buffer_destroy(device, staging);
 
-	return buffer;
+static void vkhelper_barriers_clear(struct vkhelper_barriers* barriers)
+{
+	barriers->nr_buffers = 0;
+	barriers->nr_images = 0;
+	barriers->stages = 0;
 }
 
 
-struct vkhelper_image* vkhelper_image_create(struct vkhelper_device* device, void* data, int width, int height)
+static void vkhelper_barriers_move(struct vkhelper_barriers* dst, struct vkhelper_barriers* src)
 {
-	size_t size;
-	void* ptr;
-	struct vkhelper_buffer* staging = NULL;
-	struct vkhelper_image*	image = NULL;
+	uint32_t i;
 
-	size = width * height * 4;
+	for(i = 0;i < src->nr_buffers;++i)
+		vkhelper_barriers_add_buffer(dst, src->stages, &src->buffers[i]);
+	for(i = 0;i < src->nr_images;++i)
+		vkhelper_barriers_add_image(dst, src->stages, &src->images[i]);
 
-	image = calloc(1, sizeof(struct vkhelper_image));
+	vkhelper_barriers_clear(src);
+}
 
-	staging = vkhelper_buffer_create(device, VKHELPER_BUFFER_USAGE_STAGING, size);
 
-	vkMapMemory(device->device, staging->memory, 0, size, 0, &ptr);
-	memcpy(ptr, data, size);
-	vkUnmapMemory(device->device, staging->memory);
+static void vkhelper_barriers_record(struct vkhelper_barriers* barriers, VkCommandBuffer cmdbuf, VkPipelineStageFlags src_stage)
+{
+	if(!barriers->nr_buffers && !barriers->nr_images)
+		return;
 
-	vkCreateImage
+	vkCmdPipelineBarrier
 	(
-		device->device,
-		&(VkImageCreateInfo)
-		{
-			.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
-			.imageType = VK_IMAGE_TYPE_2D,
-			.extent.width = width,
-			.extent.height = height,
-			.extent.depth = 1,
-			.mipLevels = 1,
-			.arrayLayers = 1,
-			.format = VK_FORMAT_B8G8R8A8_UNORM,
-			.tiling = VK_IMAGE_TILING_OPTIMAL,
-			.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-			.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
-			.sharingMode = VK_SHARING_MODE_EXCLUSIVE,
-			.samples = VK_SAMPLE_COUNT_1_BIT,
-		},
-		NULL, &image->image
+		cmdbuf, src_stage, barriers->stages, 0, 0, NULL,
+		barriers->nr_buffers, barriers->buffers, barriers->nr_images, barriers->images
 	);
+	vkhelper_barriers_clear(barriers);
+}
 
-	image->memory = vkhelper_memory_allocate(device, True, image->image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
 
-	vkhelper_begin_cmdbuf(device);
-	vkCmdPipelineBarrier
-	(
-		device->cmdbuf, VK_PIPELINE_STAGE_HOST_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0, NULL, 1,
-		&(VkImageMemoryBarrier)
-		{
-			.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-			.image = image->image,
-			.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-			.subresourceRange.levelCount = 1,
-			.subresourceRange.layerCount = 1,
-			.srcAccessMask = 0,
-			.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
-			.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-			.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-		}
-	);
-	vkCmdCopyBufferToImage
-	(
-		device->cmdbuf, staging->buffer, image->image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1,
-		&(VkBufferImageCopy)
-		{
-			.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-			.imageSubresource.layerCount = 1,
-			.imageExtent =
-			{
-				width,
-				height,
-				1,
-			},
-		}
-	);
-	vkCmdPipelineBarrier
-	(
-		device->cmdbuf, VK_PIPELINE_STAGE_HOST_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, 0, NULL, 1,
-		&(VkImageMemoryBarrier)
-		{
-			.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-			.image = image->image,
-			.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-			.subresourceRange.levelCount = 1,
-			.subresourceRange.layerCount = 1,
-			.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
-			.dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
-			.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-			.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+/* Drop the barriers on buffer; the pipeline stages are left as they are */
+static void vkhelper_barriers_remove_buffer(struct vkhelper_barriers* barriers, VkBuffer buffer)
+{
+	uint32_t i, n = 0;
+
+	for(i = 0;i < barriers->nr_buffers;++i)
+	{
+		if(barriers->buffers[i].buffer != buffer)
+			barriers->buffers[n++] = barriers->buffers[i];
+	}
+
+	barriers->nr_buffers = n;
+}
+
+
+/* As vkhelper_barriers_remove_buffer(), for image */
+static void vkhelper_barriers_remove_image(struct vkhelper_barriers* barriers, VkImage image)
+{
+	uint32_t i, n = 0;
+
+	for(i = 0;i < barriers->nr_images;++i)
+	{
+		if(barriers->images[i].image != image)
+			barriers->images[n++] = barriers->images[i];
+	}
+
+	barriers->nr_images = n;
+}
+
+
+static void vkhelper_barriers_free(struct vkhelper_barriers* barriers)
+{
+	free(barriers->buffers);
+	free(barriers->images);
+	memset(barriers, 0, sizeof(struct vkhelper_barriers));
+}
+
+
+static void vkhelper_mipmaps_add(struct vkhelper_mipmaps* mipmaps, struct vkhelper_image* image)
+{
+	if(mipmaps->nr_images == mipmaps->max_images)
+	{
+		mipmaps->max_images = mipmaps->max_images ? mipmaps->max_images * 2 : 8;
+		mipmaps->images = realloc(mipmaps->images, mipmaps->max_images * sizeof(struct vkhelper_image*));
+	}
+
+	mipmaps->images[mipmaps->nr_images++] = image;
+}
+
+
+static void vkhelper_mipmaps_remove(struct vkhelper_mipmaps* mipmaps, struct vkhelper_image* image)
+{
+	uint32_t i, n = 0;
+
+	for(i = 0;i < mipmaps->nr_images;++i)
+	{
+		if(mipmaps->images[i] != image)
+			mipmaps->images[n++] = mipmaps->images[i];
+	}
+
+	mipmaps->nr_images = n;
+}
+
+
+static void vkhelper_mipmaps_move(struct vkhelper_mipmaps* dst, struct vkhelper_mipmaps* src)
+{
+	uint32_t i;
+
+	for(i = 0;i < src->nr_images;++i)
+		vkhelper_mipmaps_add(dst, src->images[i]);
+
+	src->nr_images = 0;
+}
+
+
+/* Fill levels 1 and up of every image from level 0, which holds the upload
+ * in TRANSFER_DST_OPTIMAL like the rest, and leave them all ready for the
+ * fragment shader. Each level is one barrier for all images, then their
+ * blits or dispatches. Needs a graphics queue for blits, compute for
+ * mipmap.comp. */
+static void vkhelper_cmd_generate_mipmaps(struct vkhelper_device* device, VkCommandBuffer cmdbuf, struct vkhelper_mipmaps* mipmaps)
+{
+	uint32_t i;
+	uint32_t level;
+	uint32_t max_levels = 0;
+	int compute = False;
+	int width, height;
+	VkPipelineStageFlags src_stages = VK_PIPELINE_STAGE_TRANSFER_BIT;
+	VkImageMemoryBarrier barrier;
+	struct vkhelper_image* image;
+	struct vkhelper_barriers barriers = { 0 };
+
+	if(!mipmaps->nr_images)
+		return;
+
+	for(i = 0;i < mipmaps->nr_images;++i)
+	{
+		image = mipmaps->images[i];
+		if(image->levels > max_levels)
+			max_levels = image->levels;
+		compute |= image->compute;
+	}
+
+	if(compute)
+		vkCmdBindPipeline(cmdbuf, VK_PIPELINE_BIND_POINT_COMPUTE, device->mippipeline);
+
+	for(level = 1;level <= max_levels;++level)
+	{
+		/* level - 1 is complete: make it the source of level */
+		for(i = 0;i < mipmaps->nr_images;++i)
+		{
+			image = mipmaps->images[i];
+			if(level > image->levels)
+				continue;
+
+			barrier = (VkImageMemoryBarrier)
+			{
+				.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+				.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+				.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+				.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+				.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+				.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+				.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+				.image = image->image,
+				.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+				.subresourceRange.baseMipLevel = level - 1,
+				.subresourceRange.levelCount = 1,
+				.subresourceRange.layerCount = 1,
+			};
+
+			if(image->compute)
+			{
+				/* mipmap.comp keeps every level in GENERAL */
+				barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+				barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+				if(level == 1)
+				{
+					barrier.subresourceRange.levelCount = VK_REMAINING_MIP_LEVELS;
+				}
+				else
+				{
+					barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+					barrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+				}
+				vkhelper_barriers_add_image(&barriers, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, &barrier);
+			}
+			else
+			{
+				vkhelper_barriers_add_image(&barriers, VK_PIPELINE_STAGE_TRANSFER_BIT, &barrier);
+			}
 		}
+		vkhelper_barriers_record(&barriers, cmdbuf, src_stages);
+		src_stages = VK_PIPELINE_STAGE_TRANSFER_BIT | (compute ? VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT : 0);
+
+		for(i = 0;i < mipmaps->nr_images;++i)
+		{
+			image = mipmaps->images[i];
+			if(level >= image->levels)
+				continue;
+
+			width = image->width >> level ? image->width >> level : 1;
+			height = image->height >> level ? image->height >> level : 1;
+
+			if(image->compute)
+			{
+				vkCmdBindDescriptorSets(cmdbuf, VK_PIPELINE_BIND_POINT_COMPUTE, device->miplayout, 0, 1, &image->level_sets[level - 1], 0, NULL);
+				vkCmdDispatch
+				(
+					cmdbuf,
+					(width + VKHELPER_MIPMAP_GROUP_SIZE - 1) / VKHELPER_MIPMAP_GROUP_SIZE,
+					(height + VKHELPER_MIPMAP_GROUP_SIZE - 1) / VKHELPER_MIPMAP_GROUP_SIZE,
+					1
+				);
+				continue;
+			}
+
+			vkCmdBlitImage
+			(
+				cmdbuf,
+				image->image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+				image->image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+				1,
+				&(VkImageBlit)
+				{
+					.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+					.srcSubresource.mipLevel = level - 1,
+					.srcSubresource.layerCount = 1,
+					.srcOffsets[1] =
+					{
+						image->width >> (level - 1) ? image->width >> (level - 1) : 1,
+						image->height >> (level - 1) ? image->height >> (level - 1) : 1,
+						1,
+					},
+					.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+					.dstSubresource.mipLevel = level,
+					.dstSubresource.layerCount = 1,
+					.dstOffsets[1] =
+					{
+						width,
+						height,
+						1,
+					},
+				},
+				VK_FILTER_LINEAR
+			);
+		}
+	}
+
+	/* Every level is now a blit source, or GENERAL */
+	for(i = 0;i < mipmaps->nr_images;++i)
+	{
+		image = mipmaps->images[i];
+		vkhelper_barriers_add_image
+		(
+			&barriers, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+			&(VkImageMemoryBarrier)
+			{
+				.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+				.srcAccessMask = image->compute ? VK_ACCESS_SHADER_WRITE_BIT : VK_ACCESS_TRANSFER_WRITE_BIT,
+				.dstAccessMask = VK_ACCESS_SHADER_READ_BIT,
+				.oldLayout = image->compute ? VK_IMAGE_LAYOUT_GENERAL : VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+				.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+				.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+				.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+				.image = image->image,
+				.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+				.subresourceRange.levelCount = VK_REMAINING_MIP_LEVELS,
+				.subresourceRange.layerCount = 1,
+			}
+		);
+	}
+	vkhelper_barriers_record(&barriers, cmdbuf, src_stages);
+
+	vkhelper_barriers_free(&barriers);
+	mipmaps->nr_images = 0;
+}
+
+
+static int vkhelper_mipmap_pipeline_init(struct vkhelper_device* device)
+{
+	VkShaderModule shader;
+
+	if(device->mippipeline)
+		return 1;
+
+	vkCreateDescriptorSetLayout
+	(
+		device->device,
+		&(VkDescriptorSetLayoutCreateInfo)
+		{
+			.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+			.bindingCount = 2,
+			.pBindings = (VkDescriptorSetLayoutBinding[])
+			{
+				{
+					.binding = 0,
+					.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+					.descriptorCount = 1,
+					.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+				},
+				{
+					.binding = 1,
+					.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+					.descriptorCount = 1,
+					.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+				},
+			},
+		},
+		NULL, &device->mipsetlayout
 	);
-	vkhelper_end_cmdbuf(device);
 
+	vkCreatePipelineLayout
+	(
+		device->device,
+		&(VkPipelineLayoutCreateInfo)
+		{
+			.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+			.setLayoutCount = 1,
+			.pSetLayouts = &device->mipsetlayout,
+		},
+		NULL, &device->miplayout
+	);
+
+	shader = vkhelper_shadermodule_create(device, mipmap_comp_spv, mipmap_comp_spv_len);
+
+	vkCreateComputePipelines
+	(
+		device->device, device->pipelinecache, 1,
+		&(VkComputePipelineCreateInfo)
+		{
+			.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+			.stage =
+			{
+				.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+				.stage = VK_SHADER_STAGE_COMPUTE_BIT,
+				.module = shader,
+				.pName = "main",
+			},
+			.layout = device->miplayout,
+		},
+		NULL, &device->mippipeline
+	);
+
+	vkDestroyShaderModule(device->device, shader, NULL);
+
+	return device->mippipeline != VK_NULL_HANDLE;
+}
+
+
+/* Retire the oldest submitted upload if it completes within timeout
+ * nanoseconds. Returns 0 if nothing was retired. */
+static int vkhelper_upload_retire(struct vkhelper_device* device, uint64_t timeout)
+{
+	struct vkhelper_upload* upload;
+
+	pthread_mutex_lock(&device->lock);
+	upload = device->nr_submitted ? &device->uploads[device->upload_first] : NULL;
+	pthread_mutex_unlock(&device->lock);
+
+	if(!upload || vkWaitForFences(device->device, 1, &upload->fence, VK_TRUE, timeout) != VK_SUCCESS)
+		return 0;
+
+	vkResetFences(device->device, 1, &upload->fence);
+
+	pthread_mutex_lock(&device->lock);
+	device->staging_tail = upload->staging_end;
+	device->completed_token = upload->token;
+	vkhelper_barriers_move(&device->acquire, &upload->acquire);
+	vkhelper_mipmaps_move(&device->mipmaps, &upload->mipmaps);
+	device->upload_first = (device->upload_first + 1) % VKHELPER_MAX_UPLOADS;
+	device->nr_uploads--;
+	device->nr_submitted--;
+	pthread_cond_broadcast(&device->upload_retired);
+	pthread_mutex_unlock(&device->lock);
+
+	return 1;
+}
+
+
+static void vkhelper_upload_queue_submit(struct vkhelper_device* device, struct vkhelper_upload* upload)
+{
 	vkQueueSubmit
 	(
-		device->queue, 1,
+		device->transferqueue, 1,
 		&(VkSubmitInfo)
 		{
 			.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-			.pCommandBuffers = &device->cmdbuf,
+			.pCommandBuffers = &upload->cmdbuf,
 			.commandBufferCount = 1,
 		},
-		VK_NULL_HANDLE
+		upload->fence
 	);
-	vkQueueWaitIdle(device->queue);
+}
+
+
+/* Submits queued uploads in order, and retires them while there is nothing
+ * to submit. The fence wait times out so new uploads are not held back by
+ * a slow one. */
+static void* vkhelper_upload_worker(void* data)
+{
+	struct vkhelper_device* device = data;
+	struct vkhelper_upload* upload;
+
+	pthread_mutex_lock(&device->lock);
+
+	while(!device->worker_quit)
+	{
+		if(device->nr_submitted < device->nr_uploads)
+		{
+			upload = &device->uploads[(device->upload_first + device->nr_submitted) % VKHELPER_MAX_UPLOADS];
+			pthread_mutex_unlock(&device->lock);
+			vkhelper_upload_queue_submit(device, upload);
+			pthread_mutex_lock(&device->lock);
+			device->nr_submitted++;
+		}
+		else if(device->nr_submitted)
+		{
+			pthread_mutex_unlock(&device->lock);
+			vkhelper_upload_retire(device, 1000000);
+			pthread_mutex_lock(&device->lock);
+		}
+		else
+		{
+			pthread_cond_wait(&device->upload_queued, &device->lock);
+		}
+	}
+
+	pthread_mutex_unlock(&device->lock);
+
+	return NULL;
+}
+
+
+/* Called with lock held: block until at least one upload retires */
+static void vkhelper_upload_wait_locked(struct vkhelper_device* device)
+{
+	if(device->worker_running)
+	{
+		pthread_cond_wait(&device->upload_retired, &device->lock);
+	}
+	else
+	{
+		pthread_mutex_unlock(&device->lock);
+		vkhelper_upload_retire(device, UINT64_MAX);
+		pthread_mutex_lock(&device->lock);
+	}
+}
+
+
+static void vkhelper_upload_init(struct vkhelper_device* device)
+{
+	int i;
+
+	/* Upload command buffers are re-recorded once their fence signals */
+	vkCreateCommandPool
+	(
+		device->device,
+		&(VkCommandPoolCreateInfo)
+		{
+			.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+			.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT | VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+			.queueFamilyIndex = device->transferfamily,
+		},
+		NULL, &device->uploadpool
+	);
+
+	for(i = 0;i < VKHELPER_MAX_UPLOADS;++i)
+	{
+		vkAllocateCommandBuffers
+		(
+			device->device,
+			&(VkCommandBufferAllocateInfo)
+			{
+				.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+				.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+				.commandPool = device->uploadpool,
+				.commandBufferCount = 1,
+			},
+			&device->uploads[i].cmdbuf
+		);
+
+		vkCreateFence
+		(
+			device->device,
+			&(VkFenceCreateInfo)
+			{
+				.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+			},
+			NULL, &device->uploads[i].fence
+		);
+	}
+
+	pthread_mutex_init(&device->lock, NULL);
+	pthread_cond_init(&device->upload_queued, NULL);
+	pthread_cond_init(&device->upload_retired, NULL);
+
+	if(device->transferfamily != device->queuefamily)
+		device->worker_running = !pthread_create(&device->worker, NULL, vkhelper_upload_worker, device);
+}
+
+
+void vkhelper_device_wait_uploads(struct vkhelper_device* device)
+{
+	pthread_mutex_lock(&device->lock);
+	while(device->nr_uploads)
+		vkhelper_upload_wait_locked(device);
+	pthread_mutex_unlock(&device->lock);
+}
+
+
+static void vkhelper_upload_fini(struct vkhelper_device* device)
+{
+	int i;
+
+	vkhelper_device_wait_uploads(device);
+
+	if(device->worker_running)
+	{
+		pthread_mutex_lock(&device->lock);
+		device->worker_quit = True;
+		pthread_cond_signal(&device->upload_queued);
+		pthread_mutex_unlock(&device->lock);
+		pthread_join(device->worker, NULL);
+	}
+
+	/* Destroying a buffer takes the lock */
+	if(device->staging)
+		vkhelper_buffer_destroy(device, device->staging);
+
+	pthread_cond_destroy(&device->upload_retired);
+	pthread_cond_destroy(&device->upload_queued);
+	pthread_mutex_destroy(&device->lock);
+
+	for(i = 0;i < VKHELPER_MAX_UPLOADS;++i)
+	{
+		vkDestroyFence(device->device, device->uploads[i].fence, NULL);
+		free(device->uploads[i].copies);
+		vkhelper_barriers_free(&device->uploads[i].pre);
+		vkhelper_barriers_free(&device->uploads[i].post);
+		vkhelper_barriers_free(&device->uploads[i].acquire);
+		free(device->uploads[i].mipmaps.images);
+	}
+	vkhelper_barriers_free(&device->acquire);
+	free(device->mipmaps.images);
+
+	vkDestroyPipeline(device->device, device->mippipeline, NULL);
+	vkDestroyPipelineLayout(device->device, device->miplayout, NULL);
+	vkDestroyDescriptorSetLayout(device->device, device->mipsetlayout, NULL);
+	vkDestroyCommandPool(device->device, device->uploadpool, NULL);
+}
+
+
+static void vkhelper_upload_begin(struct vkhelper_device* device)
+{
+	struct vkhelper_upload* upload;
+
+	/* Inside a batch, uploads go into the one being gathered */
+	if(device->recording)
+		return;
+
+	if(!device->worker_running)
+	{
+		while(vkhelper_upload_retire(device, 0))
+			;
+	}
+
+	pthread_mutex_lock(&device->lock);
+	while(device->nr_uploads == VKHELPER_MAX_UPLOADS)
+		vkhelper_upload_wait_locked(device);
+	upload = &device->uploads[(device->upload_first + device->nr_uploads) % VKHELPER_MAX_UPLOADS];
+	pthread_mutex_unlock(&device->lock);
+
+	upload->token = device->upload_token + 1;
+	upload->staging_start = device->staging_head;
+	device->recording = upload;
+}
+
+
+/* Record what was gathered since vkhelper_upload_begin() and submit it, or
+ * hand it to the worker. Its staging range is retired by the fence, so
+ * there is no queue wait. */
+static void vkhelper_upload_flush(struct vkhelper_device* device)
+{
+	uint32_t i;
+	struct vkhelper_upload* upload = device->recording;
+	struct vkhelper_upload_copy* copy;
+
+	vkBeginCommandBuffer
+	(
+		upload->cmdbuf,
+		&(VkCommandBufferBeginInfo)
+		{
+			.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+			.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+		}
+	);
+
+	vkhelper_barriers_record(&upload->pre, upload->cmdbuf, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT);
+
+	for(i = 0;i < upload->nr_copies;++i)
+	{
+		copy = &upload->copies[i];
+		if(copy->buffer)
+			vkCmdCopyBuffer(upload->cmdbuf, device->staging->buffer, copy->buffer, 1, &copy->buffer_region);
+		else
+			vkCmdCopyBufferToImage(upload->cmdbuf, device->staging->buffer, copy->image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copy->image_region);
+	}
+	upload->nr_copies = 0;
+
+	/* From a transfer family, mipmaps wait for vkhelper_cmd_acquire_uploads() */
+	if(device->transferfamily == device->queuefamily)
+		vkhelper_cmd_generate_mipmaps(device, upload->cmdbuf, &upload->mipmaps);
+
+	vkhelper_barriers_record(&upload->post, upload->cmdbuf, VK_PIPELINE_STAGE_TRANSFER_BIT);
+
+	vkEndCommandBuffer(upload->cmdbuf);
+	upload->staging_end = device->staging_head;
+	device->upload_token = upload->token;
+	device->recording = NULL;
+
+	/* On the graphics queue, later submissions see the upload through
+	 * its barriers */
+	if(!device->worker_running)
+		vkhelper_upload_queue_submit(device, upload);
+
+	pthread_mutex_lock(&device->lock);
+	device->nr_uploads++;
+	if(!device->worker_running)
+	{
+		device->nr_submitted++;
+		device->acquired_token = upload->token;
+	}
+	pthread_cond_signal(&device->upload_queued);
+	pthread_mutex_unlock(&device->lock);
+}
+
+
+static void vkhelper_upload_end(struct vkhelper_device* device)
+{
+	if(!device->batch)
+		vkhelper_upload_flush(device);
+}
+
+
+/* Reserve size bytes of the staging ring and return where to write them.
+ * Only waits when the ring is full. A batch that would not fit in the ring
+ * is submitted in parts. */
+static void* vkhelper_staging_alloc(struct vkhelper_device* device, VkDeviceSize size, VkDeviceSize* offset)
+{
+	VkDeviceSize pos;
+
+	size = (size + VKHELPER_STAGING_ALIGNMENT - 1) / VKHELPER_STAGING_ALIGNMENT * VKHELPER_STAGING_ALIGNMENT;
+
+	if(size > device->staging_size)
+	{
+		if(device->recording->nr_copies)
+		{
+			vkhelper_upload_flush(device);
+			vkhelper_upload_begin(device);
+		}
+
+		vkhelper_device_wait_uploads(device);
+
+		if(device->staging)
+			vkhelper_buffer_destroy(device, device->staging);
+
+		device->staging_size = size > VKHELPER_STAGING_SIZE ? size : VKHELPER_STAGING_SIZE;
+		device->staging = vkhelper_buffer_create(device, VKHELPER_BUFFER_USAGE_STAGING, device->staging_size);
+		device->staging_map = vkhelper_memory_map(&device->staging->memory);
+		device->staging_head = device->staging_tail = 0;
+		device->recording->staging_start = 0;
+	}
+
+	/* An upload never wraps around; skip what is left at the end instead */
+	pos = device->staging_head % device->staging_size;
+	if(pos + size > device->staging_size)
+		pos = device->staging_size - pos;
+	else
+		pos = 0;
+
+	if(device->recording->nr_copies && device->staging_head + pos + size - device->recording->staging_start > device->staging_size)
+	{
+		vkhelper_upload_flush(device);
+		vkhelper_upload_begin(device);
+	}
+
+	device->staging_head += pos;
+
+	pthread_mutex_lock(&device->lock);
+	while(device->nr_uploads && device->staging_head + size - device->staging_tail > device->staging_size)
+		vkhelper_upload_wait_locked(device);
+	pthread_mutex_unlock(&device->lock);
+
+	*offset = device->staging_head % device->staging_size;
+	device->staging_head += size;
+
+	return device->staging_map + *offset;
+}
+
+
+static struct vkhelper_upload_copy* vkhelper_upload_add_copy(struct vkhelper_device* device)
+{
+	struct vkhelper_upload* upload = device->recording;
+
+	if(upload->nr_copies == upload->max_copies)
+	{
+		upload->max_copies = upload->max_copies ? upload->max_copies * 2 : 8;
+		upload->copies = realloc(upload->copies, upload->max_copies * sizeof(struct vkhelper_upload_copy));
+	}
+
+	memset(&upload->copies[upload->nr_copies], 0, sizeof(struct vkhelper_upload_copy));
+	return &upload->copies[upload->nr_copies++];
+}
+
+
+/* Make the transfer writes to buffer visible to dst_stage on the graphics
+ * queue. From a transfer family of its own this is a release here and an
+ * acquire in vkhelper_cmd_acquire_uploads(). */
+static void vkhelper_upload_buffer_barrier(struct vkhelper_device* device, VkBuffer buffer, VkPipelineStageFlags dst_stage, VkAccessFlags dst_access)
+{
+	VkBufferMemoryBarrier barrier =
+	{
+		.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+		.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+		.dstAccessMask = dst_access,
+		.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		.buffer = buffer,
+		.size = VK_WHOLE_SIZE,
+	};
+
+	if(device->transferfamily != device->queuefamily)
+	{
+		barrier.srcQueueFamilyIndex = device->transferfamily;
+		barrier.dstQueueFamilyIndex = device->queuefamily;
+		barrier.dstAccessMask = 0;
+		vkhelper_barriers_add_buffer(&device->recording->post, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, &barrier);
+
+		barrier.srcAccessMask = 0;
+		barrier.dstAccessMask = dst_access;
+		vkhelper_barriers_add_buffer(&device->recording->acquire, dst_stage, &barrier);
+	}
+	else
+	{
+		vkhelper_barriers_add_buffer(&device->recording->post, dst_stage, &barrier);
+	}
+}
+
+
+/* As vkhelper_upload_buffer_barrier(), moving image from TRANSFER_DST to layout */
+static void vkhelper_upload_image_barrier(struct vkhelper_device* device, VkImage image, VkImageLayout layout, VkPipelineStageFlags dst_stage, VkAccessFlags dst_access)
+{
+	VkImageMemoryBarrier barrier =
+	{
+		.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+		.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+		.dstAccessMask = dst_access,
+		.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		.newLayout = layout,
+		.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		.image = image,
+		.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+		.subresourceRange.levelCount = VK_REMAINING_MIP_LEVELS,
+		.subresourceRange.layerCount = VK_REMAINING_ARRAY_LAYERS,
+	};
+
+	if(device->transferfamily != device->queuefamily)
+	{
+		barrier.srcQueueFamilyIndex = device->transferfamily;
+		barrier.dstQueueFamilyIndex = device->queuefamily;
+		barrier.dstAccessMask = 0;
+		vkhelper_barriers_add_image(&device->recording->post, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, &barrier);
+
+		barrier.srcAccessMask = 0;
+		barrier.dstAccessMask = dst_access;
+		vkhelper_barriers_add_image(&device->recording->acquire, dst_stage, &barrier);
+	}
+	else
+	{
+		vkhelper_barriers_add_image(&device->recording->post, dst_stage, &barrier);
+	}
+}
+
+
+void vkhelper_device_begin_upload_batch(struct vkhelper_device* device)
+{
+	device->batch = True;
+}
+
+
+vkhelper_upload_token vkhelper_device_end_upload_batch(struct vkhelper_device* device)
+{
+	device->batch = False;
+	if(device->recording)
+		vkhelper_upload_flush(device);
+
+	return device->upload_token;
+}
+
+
+void vkhelper_cmd_acquire_uploads(struct vkhelper_device* device, VkCommandBuffer cmdbuf)
+{
+	struct vkhelper_barriers* acquire = &device->acquire;
+
+	pthread_mutex_lock(&device->lock);
+
+	vkhelper_barriers_record(acquire, cmdbuf, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT);
+	vkhelper_cmd_generate_mipmaps(device, cmdbuf, &device->mipmaps);
+
+	if(device->completed_token > device->acquired_token)
+		device->acquired_token = device->completed_token;
+
+	pthread_mutex_unlock(&device->lock);
+}
+
+
+int vkhelper_upload_is_ready(struct vkhelper_device* device, vkhelper_upload_token token)
+{
+	int ready;
+
+	pthread_mutex_lock(&device->lock);
+	ready = token <= device->acquired_token;
+	pthread_mutex_unlock(&device->lock);
+
+	return ready;
+}
+
+
+void vkhelper_upload_wait(struct vkhelper_device* device, vkhelper_upload_token token)
+{
+	/* The token may be part of a batch that is still being recorded */
+	if(device->recording && token > device->upload_token)
+		vkhelper_upload_flush(device);
+
+	pthread_mutex_lock(&device->lock);
+	while(device->completed_token < token && device->nr_uploads)
+		vkhelper_upload_wait_locked(device);
+	pthread_mutex_unlock(&device->lock);
+}
+
+
+struct vkhelper_buffer* vkhelper_vertex_buffer_create(struct vkhelper_device* device, void* data, size_t size)
+{
+	VkDeviceSize		offset;
+	struct vkhelper_buffer* buffer = NULL;
+	struct vkhelper_upload_copy* copy;
+
+	buffer = vkhelper_buffer_create(device, VKHELPER_BUFFER_USAGE_VERTEX, size);
+
+	vkhelper_upload_begin(device);
+	memcpy(vkhelper_staging_alloc(device, size, &offset), data, size);
+
+	copy = vkhelper_upload_add_copy(device);
+	copy->buffer = buffer->buffer;
+	copy->buffer_region.srcOffset = offset;
+	copy->buffer_region.size = size;
+	vkhelper_upload_buffer_barrier(device, buffer->buffer, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT);
+
+	buffer->upload = device->recording->token;
+	vkhelper_upload_end(device);
+
+	return buffer;
+}
+
+
+/* Blit the mip chain when the format can be filtered linearly, else build
+ * it with mipmap.comp through r32ui views, else go without */
+static void vkhelper_image_choose_mipmaps(struct vkhelper_device* device, struct vkhelper_image* image, VkImageUsageFlags* usage, VkImageCreateFlags* flags)
+{
+	const VkFormatFeatureFlags blit = VK_FORMAT_FEATURE_BLIT_SRC_BIT | VK_FORMAT_FEATURE_BLIT_DST_BIT | VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+
+	VkFormatProperties		formatprops;
+	VkImageFormatProperties		imageprops;
+
+	for(image->levels = 1;(image->width | image->height) >> image->levels;++image->levels)
+		;
+
+	/* A 1x1 image has nothing to generate */
+	if(image->levels == 1)
+		return;
+
+	vkGetPhysicalDeviceFormatProperties(device->phydevice, VKHELPER_IMAGE_FORMAT, &formatprops);
+
+	if((device->queueflags & VK_QUEUE_GRAPHICS_BIT) && (formatprops.optimalTilingFeatures & blit) == blit)
+	{
+		*usage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+		return;
+	}
+
+	if
+	(
+		(device->queueflags & VK_QUEUE_COMPUTE_BIT) &&
+		vkGetPhysicalDeviceImageFormatProperties
+		(
+			device->phydevice, VKHELPER_IMAGE_FORMAT, VK_IMAGE_TYPE_2D, VK_IMAGE_TILING_OPTIMAL,
+			*usage | VK_IMAGE_USAGE_STORAGE_BIT, VK_IMAGE_CREATE_MUTABLE_FORMAT_BIT, &imageprops
+		) == VK_SUCCESS &&
+		vkhelper_mipmap_pipeline_init(device)
+	)
+	{
+		image->compute = True;
+		*usage |= VK_IMAGE_USAGE_STORAGE_BIT;
+		*flags |= VK_IMAGE_CREATE_MUTABLE_FORMAT_BIT;
+		return;
+	}
+
+	image->levels = 1;
+}
+
+
+/* One r32ui storage view per level and a descriptor set per step down */
+static void vkhelper_image_create_level_sets(struct vkhelper_device* device, struct vkhelper_image* image)
+{
+	uint32_t i;
+
+	image->level_views = calloc(image->levels, sizeof(VkImageView));
+	image->level_sets = calloc(image->levels - 1, sizeof(VkDescriptorSet));
+
+	for(i = 0;i < image->levels;++i)
+	{
+		vkCreateImageView
+		(
+			device->device,
+			&(VkImageViewCreateInfo)
+			{
+				.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+				.image = image->image,
+				.viewType = VK_IMAGE_VIEW_TYPE_2D,
+				.format = VK_FORMAT_R32_UINT,
+				.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+				.subresourceRange.baseMipLevel = i,
+				.subresourceRange.levelCount = 1,
+				.subresourceRange.layerCount = 1,
+			},
+			NULL, &image->level_views[i]
+		);
+	}
+
+	vkCreateDescriptorPool
+	(
+		device->device,
+		&(VkDescriptorPoolCreateInfo)
+		{
+			.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+			.maxSets = image->levels - 1,
+			.poolSizeCount = 1,
+			.pPoolSizes = &(VkDescriptorPoolSize)
+			{
+				.type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+				.descriptorCount = 2 * (image->levels - 1),
+			},
+		},
+		NULL, &image->level_pool
+	);
+
+	for(i = 0;i + 1 < image->levels;++i)
+	{
+		vkAllocateDescriptorSets
+		(
+			device->device,
+			&(VkDescriptorSetAllocateInfo)
+			{
+				.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+				.descriptorPool = image->level_pool,
+				.descriptorSetCount = 1,
+				.pSetLayouts = &device->mipsetlayout,
+			},
+			&image->level_sets[i]
+		);
+
+		vkUpdateDescriptorSets
+		(
+			device->device, 1,
+			&(VkWriteDescriptorSet)
+			{
+				.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+				.dstSet = image->level_sets[i],
+				.dstBinding = 0,
+				.descriptorCount = 2,
+				.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+				.pImageInfo = (VkDescriptorImageInfo[])
+				{
+					{
+						.imageView = image->level_views[i],
+						.imageLayout = VK_IMAGE_LAYOUT_GENERAL,
+					},
+					{
+						.imageView = image->level_views[i + 1],
+						.imageLayout = VK_IMAGE_LAYOUT_GENERAL,
+					},
+				},
+			},
+			0, NULL
+		);
+	}
+}
+
+
+struct vkhelper_image* vkhelper_image_create(struct vkhelper_device* device, void* data, int width, int height, int mipmaps)
+{
+	size_t size;
+	VkDeviceSize		offset;
+	VkImageUsageFlags	usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+	VkImageCreateFlags	flags = 0;
+	struct vkhelper_image*	image = NULL;
+	struct vkhelper_upload_copy* copy;
+
+	size = width * height * 4;
+
+	image = calloc(1, sizeof(struct vkhelper_image));
+	image->width = width;
+	image->height = height;
+	image->levels = 1;
+
+	if(mipmaps)
+		vkhelper_image_choose_mipmaps(device, image, &usage, &flags);
+
+	vkCreateImage
+	(
+		device->device,
+		&(VkImageCreateInfo)
+		{
+			.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+			.flags = flags,
+			.imageType = VK_IMAGE_TYPE_2D,
+			.extent.width = width,
+			.extent.height = height,
+			.extent.depth = 1,
+			.mipLevels = image->levels,
+			.arrayLayers = 1,
+			.format = VKHELPER_IMAGE_FORMAT,
+			.tiling = VK_IMAGE_TILING_OPTIMAL,
+			.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+			.usage = usage,
+			.sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+			.samples = VK_SAMPLE_COUNT_1_BIT,
+		},
+		NULL, &image->image
+	);
+
+	image->memory = vkhelper_memory_allocate(device, True, image->image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+	if(image->compute)
+		vkhelper_image_create_level_sets(device, image);
+
+	vkhelper_upload_begin(device);
+	memcpy(vkhelper_staging_alloc(device, size, &offset), data, size);
+
+	vkhelper_barriers_add_image
+	(
+		&device->recording->pre, VK_PIPELINE_STAGE_TRANSFER_BIT,
+		&(VkImageMemoryBarrier)
+		{
+			.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+			.image = image->image,
+			.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+			.subresourceRange.levelCount = image->levels,
+			.subresourceRange.layerCount = 1,
+			.srcAccessMask = 0,
+			.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+			.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+			.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+			.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+			.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+		}
+	);
+
+	copy = vkhelper_upload_add_copy(device);
+	copy->image = image->image;
+	copy->image_region = (VkBufferImageCopy)
+	{
+		.bufferOffset = offset,
+		.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+		.imageSubresource.layerCount = 1,
+		.imageExtent =
+		{
+			width,
+			height,
+			1,
+		},
+	};
+
+	if(image->levels > 1)
+	{
+		/* Blits and dispatches need the graphics queue; from a transfer
+		 * family, hand the image over as it is */
+		if(device->transferfamily != device->queuefamily)
+			vkhelper_upload_image_barrier(device, image->image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT);
+		vkhelper_mipmaps_add(&device->recording->mipmaps, image);
+	}
+	else
+	{
+		vkhelper_upload_image_barrier(device, image->image, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+	}
+
+	image->upload = device->recording->token;
+	vkhelper_upload_end(device);
 
 	vkCreateImageView
 	(
@@ -862,22 +2272,41 @@ struct vkhelper_image* vkhelper_image_create(struct vkhelper_device* device, voi
 			.viewType = VK_IMAGE_VIEW_TYPE_2D,
 			.format = VK_FORMAT_A8B8G8R8_UNORM_PACK32,
 			.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-			.subresourceRange.levelCount = 1,
+			.subresourceRange.levelCount = image->levels,
 			.subresourceRange.layerCount = 1,
 		},
 		NULL, &image->view
 	);
 
-	vkhelper_buffer_destroy(device, staging);
 	return image;
 }
 
 
 void vkhelper_image_destroy(struct vkhelper_device* device, struct vkhelper_image* image)
 {
+	uint32_t i;
+
+	/* Once retired, an upload from a transfer family may still have its
+	 * acquire and mipmaps waiting for vkhelper_cmd_acquire_uploads() */
+	vkhelper_upload_wait(device, image->upload);
+
+	pthread_mutex_lock(&device->lock);
+	vkhelper_barriers_remove_image(&device->acquire, image->image);
+	vkhelper_mipmaps_remove(&device->mipmaps, image);
+	pthread_mutex_unlock(&device->lock);
+
+	if(image->compute)
+	{
+		vkDestroyDescriptorPool(device->device, image->level_pool, NULL);
+		for(i = 0;i < image->levels;++i)
+			vkDestroyImageView(device->device, image->level_views[i], NULL);
+		free(image->level_sets);
+		free(image->level_views);
+	}
+
 	vkDestroyImageView(device->device, image->view, NULL);
 	vkDestroyImage(device->device, image->image, NULL);
-	vkFreeMemory(device->device, image->memory, NULL);
+	vkhelper_memory_free(device, &image->memory);
 	free(image);
 }
 
@@ -888,6 +2317,12 @@ VkImageView vkhelper_image_get_vkimageview(struct vkhelper_image* image)
 }
 
 
+vkhelper_upload_token vkhelper_image_get_upload_token(struct vkhelper_image* image)
+{
+	return image->upload;
+}
+
+
 uint32_t vkhelper_acquire_next_index(struct vkhelper_device* device)
 {
 	uint32_t index = 0;
@@ -1043,7 +2478,7 @@ VkPipeline vkhelper_create_graphics_pipeline
 
 	vkCreateGraphicsPipelines
 	(
-		device->device, VK_NULL_HANDLE, 1,
+		device->device, device->pipelinecache, 1,
 		&(VkGraphicsPipelineCreateInfo)
 		{
 			.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
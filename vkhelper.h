@@ -21,6 +21,25 @@ typedef struct vkhelper_buffer		vkhelper_buffer;
 typedef struct vkhelper_image		vkhelper_image;
 typedef struct vkhelper_renderpass	vkhelper_renderpass;
 
+/* Device memory in use by vkhelper buffers and images */
+struct vkhelper_memory_stats
+{
+	uint32_t	nr_blocks;
+	uint32_t	nr_allocations;
+	VkDeviceSize	bytes_reserved;		/* allocated from the device */
+	VkDeviceSize	bytes_used;		/* handed out to buffers and images */
+	VkDeviceSize	bytes_free;
+	VkDeviceSize	largest_free;
+	float		fragmentation;		/* 1 - largest_free / bytes_free */
+};
+typedef struct vkhelper_memory_stats	vkhelper_memory_stats;
+
+/* Identifies the upload of a buffer or image; 0 is always ready. Uploads
+ * run on a transfer queue family of its own when the device has one, and
+ * are ready for the graphics queue after vkhelper_cmd_acquire_uploads()
+ * has recorded the queue family acquire for them. */
+typedef uint64_t			vkhelper_upload_token;
+
 
 vkhelper_device*	vkhelper_device_create_with_xlib	(Display* display, Window window);
 vkhelper_device*	vkhelper_device_create_with_vkdevice	(VkPhysicalDevice phydevice, VkDevice device, int queuefamily);
@@ -28,6 +47,18 @@ void			vkhelper_device_destroy			(vkhelper_device* device);
 VkDevice		vkhelper_device_get_vkdevice		(vkhelper_device* device);
 void			vkhelper_device_set_swapchain		(vkhelper_device* device, vkhelper_swapchain* swapchain);
 vkhelper_swapchain*	vkhelper_device_get_swapchain		(vkhelper_device* device);
+void			vkhelper_device_get_memory_stats	(vkhelper_device* device, vkhelper_memory_stats* stats);
+void			vkhelper_device_wait_uploads		(vkhelper_device* device);
+
+/* Uploads between begin and end are recorded into one command buffer and
+ * submitted once, with one fence, unless they overflow the staging ring or
+ * one of them is waited for. end returns the token of the last one. */
+void			vkhelper_device_begin_upload_batch	(vkhelper_device* device);
+vkhelper_upload_token	vkhelper_device_end_upload_batch	(vkhelper_device* device);
+
+void	vkhelper_cmd_acquire_uploads	(vkhelper_device* device, VkCommandBuffer cmdbuf);
+int	vkhelper_upload_is_ready	(vkhelper_device* device, vkhelper_upload_token token);
+void	vkhelper_upload_wait		(vkhelper_device* device, vkhelper_upload_token token);
 
 vkhelper_swapchain*	vkhelper_swapchain_create			(vkhelper_device* device, int width, int height, int min_count);
 vkhelper_swapchain*	vkhelper_swapchain_create_with_vkswapchain	(vkhelper_device* device, VkSwapchainKHR vkswapchain, const VkSwapchainCreateInfoKHR* info);
@@ -48,11 +79,13 @@ VkShaderModule	vkhelper_shadermodule_create(vkhelper_device* device, const unsig
 vkhelper_buffer*	vkhelper_buffer_create		(vkhelper_device* device, enum vkhelper_buffer_usage usage, size_t size);
 void			vkhelper_buffer_destroy		(vkhelper_device* device, vkhelper_buffer* buffer);
 VkBuffer		vkhelper_buffer_get_vkbuffer	(vkhelper_buffer* buffer);
+vkhelper_upload_token	vkhelper_buffer_get_upload_token(vkhelper_buffer* buffer);
 vkhelper_buffer*	vkhelper_vertex_buffer_create	(vkhelper_device* device, void* data, size_t size);
 
-vkhelper_image*	vkhelper_image_create		(vkhelper_device* device, void* image, int width, int height);
+vkhelper_image*	vkhelper_image_create		(vkhelper_device* device, void* image, int width, int height, int mipmaps);
 void		vkhelper_image_destroy		(vkhelper_device* device, vkhelper_image* image);
 VkImageView	vkhelper_image_get_vkimageview	(vkhelper_image* image);
+vkhelper_upload_token	vkhelper_image_get_upload_token	(vkhelper_image* image);
 
 uint32_t	vkhelper_acquire_next_index	(vkhelper_device* device);
 void		vkhelper_queue_submit		(vkhelper_device* device, uint32_t index);